@@ -0,0 +1,166 @@
+/*
+ * File:   checkpoint.h
+ *
+ * Incremental checkpoints of a Q-table during learning (see
+ * RLSTRATEGO_CHECKPOINT_DIR in uppaal_external_learner_alloc).
+ *
+ * A checkpoint directory holds numbered files 000000.qt, 000001.qt, ... in the
+ * format of qtable_io.h. The first one holds every entry learned up to then
+ * (the base), each following one only the entries changed since the previous
+ * checkpoint (a delta). Replaying them in order, later records replacing
+ * earlier ones, rebuilds the table as of the last checkpoint.
+ *
+ * Files are written by a background thread, first under a temporary name and
+ * then renamed, so an interrupted run never leaves a partial checkpoint. Once
+ * a checkpoint cannot be written, no further ones are: the deltas after it
+ * could not be replayed.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "qtable_io.h"
+
+class CheckpointWriter {
+    struct batch_t {
+        size_t sequence;
+        std::vector<qrecord_t> records;
+    };
+
+    std::string _dir;
+    size_t _d_size;
+    size_t _c_size;
+    size_t _sequence = 0;
+    std::deque<batch_t> _queue;
+    bool _stop = false;
+    bool _failed = false; // only accessed by the writer thread
+    std::mutex _mutex;
+    std::condition_variable _wakeup;
+    std::thread _thread;
+
+    void run() {
+        std::unique_lock<std::mutex> guard(_mutex);
+        while (true) {
+            _wakeup.wait(guard, [this] {
+                return _stop || !_queue.empty();
+            });
+            if (_queue.empty()) return; // stopped and drained
+            batch_t batch = std::move(_queue.front());
+            _queue.pop_front();
+            guard.unlock();
+            write(batch);
+            guard.lock();
+        }
+    }
+
+    void write(const batch_t& batch) {
+        if (_failed) return;
+        std::string path = checkpoint_path(_dir, batch.sequence);
+        std::string tmp = path + ".tmp";
+        bool written;
+        {
+            std::ofstream out(tmp);
+            write_qtable_header(out, _d_size, _c_size);
+            for (auto& record : batch.records) write_qrecord(out, record);
+            out.close();
+            written = !out.fail();
+        }
+        if (!written || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            std::cerr << "Could not write checkpoint " << path << ", no further checkpoints are written\n";
+            std::remove(tmp.c_str());
+            _failed = true;
+        }
+    }
+
+public:
+
+    /**
+     * Starts the writer thread for checkpoints into dir, which is created if needed.
+     */
+    CheckpointWriter(const std::string& dir, size_t d_size, size_t c_size)
+    : _dir(dir), _d_size(d_size), _c_size(c_size) {
+        mkdir(_dir.c_str(), 0777);
+        _thread = std::thread(&CheckpointWriter::run, this);
+    }
+
+    /**
+     * Writes the checkpoints still queued and stops the writer thread.
+     */
+    ~CheckpointWriter() {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _stop = true;
+        }
+        _wakeup.notify_one();
+        _thread.join();
+    }
+
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+    /**
+     * Queues the next checkpoint; returns without waiting for it to be written.
+     */
+    void submit(std::vector<qrecord_t>&& records) {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _queue.push_back({_sequence++, std::move(records)});
+        }
+        _wakeup.notify_one();
+    }
+
+    const std::string& dir() const {
+        return _dir;
+    }
+
+    static std::string checkpoint_path(const std::string& dir, size_t sequence) {
+        char name[32];
+        std::snprintf(name, sizeof (name), "%06zu.qt", sequence);
+        return dir + "/" + name;
+    }
+
+    /**
+     * Returns the checkpoint files in dir in the order they have to be replayed.
+     * Only the files numbered contiguously from 000000 are returned; a missing
+     * one is reported on stderr, as the deltas after it cannot be replayed.
+     */
+    static std::vector<std::string> checkpoint_files(const std::string& dir) {
+        std::vector<std::string> names;
+        DIR* handle = opendir(dir.c_str());
+        if (handle == nullptr) return names;
+        while (dirent* entry = readdir(handle)) {
+            std::string name = entry->d_name;
+            if (name.size() == 9 && name.compare(6, 3, ".qt") == 0
+                    && std::all_of(name.begin(), name.begin() + 6, ::isdigit))
+                names.push_back(name);
+        }
+        closedir(handle);
+        std::sort(names.begin(), names.end());
+        for (size_t i = 0; i < names.size(); ++i) {
+            names[i] = dir + "/" + names[i];
+            if (names[i] != checkpoint_path(dir, i)) {
+                std::cerr << "Checkpoint " << checkpoint_path(dir, i) << " is missing, ignoring the "
+                        << names.size() - i << " checkpoints after it\n";
+                names.resize(i);
+                break;
+            }
+        }
+        return names;
+    }
+};
+
+#endif /* CHECKPOINT_H */
@@ -1,10 +1,40 @@
 #include "external_learning.h"
 
+#include <csignal>
+
+// Only the UPPAAL entry points are exported from the library; everything else
+// is hidden when building with -fvisibility=hidden (see the Release configuration).
+#define LEARNER_API extern "C" __attribute__((visibility("default")))
+
 // we use this to check that we do not deallocate an object twice.
 // this should never happen, so this is *only* useful if you suspect that
 // Uppaal Stratego is doing something wrong.
 std::set<QLearner*> live;
 
+// number of learners allocated so far, to name per-learner output
+size_t learners = 0;
+
+// set by SIGUSR1, a memory report is written at the next flush
+volatile sig_atomic_t memory_report_requested = 0;
+
+void request_memory_report(int) {
+    memory_report_requested = 1;
+}
+
+/**
+ * Writes the memory report of a learner to the file named by
+ * RLSTRATEGO_MEMORY_REPORT (appending), or to stderr if it is not set.
+ */
+void write_memory_report(QLearner* q, const char* reason) {
+    const char* path = std::getenv("RLSTRATEGO_MEMORY_REPORT");
+    if (path != nullptr && *path != '\0') {
+        std::ofstream out(path, std::ios::app);
+        q->memory_report(out, reason);
+    } else {
+        q->memory_report(std::cerr, reason);
+    }
+}
+
 /**
  * Allocates an instance of a learner
  * @param minimization, flag for determining optimization type (minimization=true/maximization=false)
@@ -13,9 +43,64 @@ std::set<QLearner*> live;
  * @param a_size, number of (controllable) actions available in the system
  * @return a pointer to a learner object
  */
-extern "C" void* uppaal_external_learner_alloc(bool minimization, size_t d_size, size_t c_size, size_t a_size) {
+LEARNER_API void* uppaal_external_learner_alloc(bool minimization, size_t d_size, size_t c_size, size_t a_size) {
     auto object = new QLearner(minimization, d_size, c_size);
     live.insert(object); // for later sanitycheck
+    const std::string learner = std::to_string(getpid()) + "-" + std::to_string(learners++);
+    object->_name = learner;
+    if (learners == 1) {
+        // kill -USR1 <verifyta> asks for a memory report, unless the host uses the signal itself
+        struct sigaction action, previous;
+        std::memset(&action, 0, sizeof (action));
+        action.sa_handler = request_memory_report;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        if (sigaction(SIGUSR1, nullptr, &previous) == 0 && previous.sa_handler == SIG_DFL) {
+            sigaction(SIGUSR1, &action, nullptr);
+        }
+    }
+    // opt-in: learn into a table shared with the other learners on this host
+    const char* shared_path = std::getenv("RLSTRATEGO_SHARED_TABLE");
+    if (shared_path != nullptr && *shared_path != '\0') {
+        const char* slots = std::getenv("RLSTRATEGO_SHARED_SLOTS");
+        size_t capacity = slots != nullptr ? std::strtoull(slots, nullptr, 10) : 0;
+        if (capacity == 0) capacity = 1 << 20;
+        if (!object->attach_shared(shared_path, a_size, capacity)) {
+            std::cerr << "Falling back to a private Q-table\n";
+        }
+    }
+    // opt-in: incremental checkpoints at flush, one directory per learner
+    const char* checkpoint_dir = std::getenv("RLSTRATEGO_CHECKPOINT_DIR");
+    if (checkpoint_dir != nullptr && *checkpoint_dir != '\0') {
+        mkdir(checkpoint_dir, 0777);
+        std::string dir = std::string(checkpoint_dir) + "/learner-" + learner;
+        if (object->enable_checkpoints(dir)) {
+            std::cerr << "Checkpointing Q-table into " << dir << "\n";
+        }
+    }
+    // opt-in: prioritized sweeping over stored transitions at flush
+    const char* replay_capacity = std::getenv("RLSTRATEGO_REPLAY_CAPACITY");
+    if (replay_capacity != nullptr && std::strtoull(replay_capacity, nullptr, 10) != 0) {
+        const char* budget = std::getenv("RLSTRATEGO_REPLAY_BUDGET");
+        const char* threshold = std::getenv("RLSTRATEGO_REPLAY_THRESHOLD");
+        object->enable_replay(std::strtoull(replay_capacity, nullptr, 10),
+                budget != nullptr ? std::strtoull(budget, nullptr, 10) : 10000,
+                threshold != nullptr ? std::strtod(threshold, nullptr) : 1e-3);
+    }
+    // opt-in: export only the states reachable under the learned strategy
+    const char* prune = std::getenv("RLSTRATEGO_PRUNE_EXPORT");
+    if (prune != nullptr && *prune != '\0' && *prune != '0') {
+        object->enable_pruning();
+    }
+    // opt-in: per-flush convergence statistics
+    const char* telemetry_path = std::getenv("RLSTRATEGO_TELEMETRY");
+    if (telemetry_path != nullptr && *telemetry_path != '\0') {
+        const char* epsilon = std::getenv("RLSTRATEGO_CONVERGENCE_EPS");
+        const char* patience = std::getenv("RLSTRATEGO_CONVERGENCE_PATIENCE");
+        object->enable_telemetry(telemetry_path, learner,
+                epsilon != nullptr ? std::strtod(epsilon, nullptr) : 0.01,
+                patience != nullptr ? std::strtoull(patience, nullptr, 10) : 3);
+    }
     std::cerr << "-----------------------------------------------------------\n";
     std::cerr << "External Q learning - v20240129:";
 #ifdef NEAREST_NEIGHBOR
@@ -37,7 +122,7 @@ int count = 0;
  * Deallocation code for objects allocated by uppaal_external_learner_alloc
  * @param object, A pointer returned by @uppaal_external_learner_alloc
  */
-extern "C" void uppaal_external_learner_dealloc(void* object) {
+LEARNER_API void uppaal_external_learner_dealloc(void* object) {
     QLearner* obj = (QLearner*) object;
 #ifndef ANALYSE
     std::cerr << "Learn: ";
@@ -48,6 +133,11 @@ extern "C" void uppaal_external_learner_dealloc(void* object) {
     if (obj->_is_minimization) std::cerr << "min - ";
     else std::cerr << "max - ";
     std::cerr << count++ << ":: Q-table's length: " << obj->length() << "\n";
+    obj->report_uncovered(); // anything not reported by a flush yet
+    obj->checkpoint();
+    if (!obj->_name.empty()) {
+        write_memory_report(obj, "dealloc");
+    }
     //obj->reduce();
     if (obj != nullptr && live.count(obj) != 1) {
         assert(false && "Call-sequence from UPPAAL was wrong, please report to the UPPAAL developers");
@@ -67,9 +157,22 @@ extern "C" void uppaal_external_learner_dealloc(void* object) {
  * @param a_size
  * @return 
  */
-extern "C" void* uppaal_external_learner_parse(const char* data, bool is_min, size_t d_size, size_t c_size, size_t a_size) {
+LEARNER_API void* uppaal_external_learner_parse(const char* data, bool is_min, size_t d_size, size_t c_size, size_t a_size) {
     auto object = new QLearner(is_min, d_size, c_size);
     live.insert(object); // for later sanitycheck
+    // restore a saved (e.g. merged) table or a checkpoint directory instead of starting empty
+    const char* path = std::getenv("RLSTRATEGO_QTABLE_IN");
+    struct stat st;
+    if (path != nullptr && *path != '\0' && stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (!object->load_checkpoint(path)) {
+            std::cerr << "Could not load Q-table checkpoints from " << path << "\n";
+        }
+    } else if (path != nullptr && *path != '\0') {
+        std::ifstream in(path);
+        if (!object->load_table(in)) {
+            std::cerr << "Could not load Q-table from " << path << "\n";
+        }
+    }
     return object;
 }
 
@@ -77,10 +180,18 @@ extern "C" void* uppaal_external_learner_parse(const char* data, bool is_min, si
  * Write the state of the learner (called by saveStrategy in uppaal)
  * @param object, A pointer returned by @uppaal_external_learner_alloc
  */
-extern "C" char* uppaal_external_learner_print(void* object) {
+LEARNER_API char* uppaal_external_learner_print(void* object) {
     std::stringstream outstream;
     QLearner* ql = (QLearner*) object;
+    bool was_learning = ql->learning;
     ql->print(outstream); 
+    // the first print ends learning; keep the raw table for merging if asked to,
+    // one file per learner allocated by UPPAAL (not for clones or parsed learners)
+    const char* path = std::getenv("RLSTRATEGO_QTABLE_OUT");
+    if (was_learning && path != nullptr && *path != '\0' && !ql->_name.empty()) {
+        std::ofstream out(std::string(path) + "." + ql->_name);
+        ql->save_table(out);
+    }
     auto data = outstream.str(); // convert the stream into a regular string object
     char* tmp = new char[data.size() + 1]; // create a c-style string with enough space
     strcpy(tmp, data.c_str()); // copy over the data
@@ -93,9 +204,10 @@ extern "C" char* uppaal_external_learner_print(void* object) {
  * @param object, A pointer returned by @uppaal_external_learner_alloc
  * @return a pointer to a duplicate/deep-copy of object
  */
-extern "C" void* uppaal_external_learner_clone(void* object) {
+LEARNER_API void* uppaal_external_learner_clone(void* object) {
     assert(object != nullptr);
     auto new_object = new QLearner(*(QLearner*) object);
+    new_object->make_snapshot(); // a clone is a snapshot, not another view of a shared table
     live.insert(new_object);
     return new_object;
 }
@@ -111,7 +223,7 @@ extern "C" void* uppaal_external_learner_clone(void* object) {
  * @param t_c_vars, the continuous state-vector of the target state
  * @param value, the observed cost/reward (see @uppaal_external_learner_alloc, minimization)
  */
-extern "C" void uppaal_external_learner_sample_handler(void* object, size_t action,
+LEARNER_API void uppaal_external_learner_sample_handler(void* object, size_t action,
         double* from_d_vars, double* from_c_vars,
         double* t_d_vars, double* t_c_vars, double value) {
     if (object == nullptr) {
@@ -124,7 +236,7 @@ extern "C" void uppaal_external_learner_sample_handler(void* object, size_t acti
     return;
 }
 
-extern "C" void uppaal_external_learner_online_sample_handler(void* object, size_t action,
+LEARNER_API void uppaal_external_learner_online_sample_handler(void* object, size_t action,
         double* from_d_vars, double* from_c_vars,
         double* t_d_vars, double* t_c_vars, double value) {
     return;
@@ -139,26 +251,29 @@ extern "C" void uppaal_external_learner_online_sample_handler(void* object, size
  * @param d_vars, the observed discrete state-vector
  * @param t_vars, the observed continuous state-vector
  */
-extern "C" double uppaal_external_learner_predict(void* object, bool is_eval, size_t action, double* d_vars, double* c_vars) {
+LEARNER_API double uppaal_external_learner_predict(void* object, bool is_eval, size_t action, double* d_vars, double* c_vars) {
     // you can control search here!
     // return ONLY weights > 0, non inf and non nan.
     // a weighted choice will be done over all actions according to the weight
     auto q = (QLearner*) object;
     double reward = 0.0;
     //    std::ostream& out = std::cerr;
-    auto from_state = q->make_state(d_vars, c_vars);
     //    size_t to_action = action;
-    bool found = false, allowed = false;
+    bool found = false, allowed = false, uncovered = false;
 
     if (!q->learning) {
         q->mark(d_vars, c_vars, action);
     }
 
     if (is_eval) {
-        allowed = q->is_allowed(d_vars, c_vars, action, &found);
+        allowed = q->is_allowed(d_vars, c_vars, action, &found, &uncovered);
         if (allowed & found) {
             reward = 1.0;
         } else if(found) {
+            // count repeated hits on pairs already reported as uncovered
+            if (!q->learning && uncovered) {
+                q->note_uncovered(d_vars, c_vars, action);
+            }
             reward = 0.0;
         } else {
             //Q-table does not contain the state
@@ -170,8 +285,7 @@ extern "C" double uppaal_external_learner_predict(void* object, bool is_eval, si
             //std::cerr << q->learning;
             if (!q->learning) { 
                 q->add_uncovered(d_vars, c_vars, action);
-                std::cerr << "State-action pair (<" << from_state.first[0] << "," 
-                          << from_state.first[1] << ">," << action << ") is not found! \n";
+                q->note_uncovered(d_vars, c_vars, action);
                 //assert(false);
             }
             reward = 0.0;
@@ -227,7 +341,26 @@ extern "C" double uppaal_external_learner_predict(void* object, bool is_eval, si
  * Batch-completion call-back
  * @param object, A pointer returned by @uppaal_external_learner_alloc
  */
-extern "C" void uppaal_external_learner_flush(void* object) {
-    // not used by q-learning
+LEARNER_API void uppaal_external_learner_flush(void* object) {
+    if (object == nullptr) {
+        return;
+    }
+    auto q = (QLearner*) object;
+    // write out the uncovered state-action pairs seen in this batch
+    q->report_uncovered();
+    q->replay();
+    q->end_trace_batch();
+    q->checkpoint();
+    q->report_convergence();
+    // memory report on request (SIGUSR1) or every RLSTRATEGO_MEMORY_REPORT_EVERY flushes
+    static const char* every = std::getenv("RLSTRATEGO_MEMORY_REPORT_EVERY");
+    static const size_t period = every != nullptr ? std::strtoull(every, nullptr, 10) : 0;
+    ++q->_flushes;
+    if (memory_report_requested) {
+        memory_report_requested = 0;
+        write_memory_report(q, "SIGUSR1");
+    } else if (period != 0 && q->_flushes % period == 0) {
+        write_memory_report(q, "periodic");
+    }
     return;
 }
\ No newline at end of file
@@ -16,9 +16,13 @@
 
 #define CEG
 //#define COMPACT
+// in CEG mode, export uncovered cells merged into hyper-rectangular regions
+//#define REGION_EXPORT
 
 #include <iostream>
+#include <fstream>
 #include <cassert>
+#include <cstdlib>
 #include <set>
 #include <map>
 #include <vector>
@@ -29,7 +33,14 @@
 #include <math.h>
 #include <limits>
 #include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <queue>
 
+#include "qtable_io.h"
+#include "shared_qtable.h"
+#include "checkpoint.h"
+#include "transition_store.h"
 
 /**
  * Simple implementation of a Q-learning algorithm
@@ -44,6 +55,8 @@ class QLearner {
 private:
 
     const double min_reward = -32767.0;
+    const double gamma = 0.99; // discount, we could make it converge to zero by making this dependent on the number of samples seen for this state-action-pair
+    const double alpha = 2.0; // constant learning rate
     /**
      * Struct for handling the Q-value update
      */
@@ -55,6 +68,7 @@ private:
 #endif
         bool _select = false;
         bool _uncover = false;
+        bool _dirty = false; // changed since the last checkpoint
     };
     size_t count = 0;
     // type for mapping actions to values
@@ -68,12 +82,139 @@ private:
 
     // actual values
     qtable_t _Q;
+
+    // table shared with other processes while learning, if attached (see attach_shared),
+    // or the copy of it taken when learning ended or the learner was cloned (see freeze).
+    // _Q then only holds the entries this learner keeps to itself, which take precedence.
+    std::shared_ptr<SharedQTable> _shared;
+    std::shared_ptr<const qtable_t> _base;
+
+    // writer of incremental checkpoints, if enabled, and the entries changed since the last one
+    struct dirty_t {
+        const qstate_t* state;
+        size_t action;
+        const qvalue_t* q;
+    };
+    std::shared_ptr<CheckpointWriter> _checkpoint;
+    std::vector<dirty_t> _dirty;
+
+    // convergence statistics of the current batch (between flushes), if enabled
+    struct telemetry_t {
+        std::ofstream log;
+        std::string path;
+        std::string learner;
+        double epsilon;
+        size_t patience;
+        size_t batch = 0;
+        size_t quiet_batches = 0; // consecutive batches without significant change
+        size_t last_length = 0;
+        bool converged = false;
+        size_t samples = 0;
+        size_t updates = 0; // samples of pairs which already had a value
+        size_t new_pairs = 0;
+        size_t flips = 0;
+        double max_change = 0;
+        double sum_change = 0;
+        size_t replay_backups = 0; // made by replay at the end of the batch
+        size_t replay_flips = 0;
+        double replay_max_change = 0;
+    };
+    std::shared_ptr<telemetry_t> _telemetry;
+
+    // stored transitions for prioritized sweeping at flush, if enabled
+    struct replay_t {
+        TransitionStore<qstate_t> store;
+        size_t budget; // backups per flush
+        double threshold; // smallest Bellman error worth a backup
+
+        replay_t(size_t capacity, size_t budget, double threshold)
+        : store(capacity), budget(budget), threshold(threshold) {
+        }
+    };
+    std::shared_ptr<replay_t> _replay;
+
+    // successor graph of the sampled transitions, for pruning the exported strategy if enabled.
+    // States are the keys of their nodes in _Q; a target not in _Q when it was
+    // sampled (the last state of a trace) is kept in outside instead.
+    struct reachability_t {
+        std::set<qstate_t> outside;
+        std::map<std::pair<const qstate_t*, size_t>, std::vector<const qstate_t*>> successors;
+        std::set<const qstate_t*> initial; // first states of the sampled traces
+        const qstate_t* trace_head = nullptr; // origin of the previous sample
+
+        /**
+         * Records a sample. The samples of a trace arrive last transition
+         * first, so a sample whose target is not the origin of the previous
+         * sample starts a new trace, and that origin began the previous one.
+         */
+        void add(const qstate_t* from, size_t action, const qstate_t* to) {
+            auto& next = successors[{from, action}];
+            if (std::find(next.begin(), next.end(), to) == next.end()) next.push_back(to);
+            if (trace_head != nullptr && trace_head != to) initial.insert(trace_head);
+            trace_head = from;
+        }
+
+        /**
+         * Returns a copy of the graph for table, a copy of the table the graph
+         * was recorded on.
+         */
+        std::shared_ptr<reachability_t> copy_for(const qtable_t& table) const {
+            auto copy = std::make_shared<reachability_t>();
+            copy->outside = outside;
+            std::map<const qstate_t*, const qstate_t*> moved;
+            auto move = [&](const qstate_t* state) {
+                auto it = moved.find(state);
+                if (it != moved.end()) return it->second;
+                auto in_table = table.find(*state);
+                const qstate_t* to = in_table != table.end() ? &in_table->first : &*copy->outside.find(*state);
+                moved.emplace(state, to);
+                return to;
+            };
+            for (auto& edges : successors) {
+                auto& next = copy->successors[{move(edges.first.first), edges.first.second}];
+                for (const qstate_t* state : edges.second) next.push_back(move(state));
+            }
+            for (const qstate_t* state : initial) copy->initial.insert(move(state));
+            if (trace_head != nullptr) copy->trace_head = move(trace_head);
+            return copy;
+        }
+
+        /**
+         * Marks the end of a batch; the last trace is complete.
+         */
+        void end_batch() {
+            if (trace_head != nullptr) initial.insert(trace_head);
+            trace_head = nullptr;
+        }
+    };
+    std::shared_ptr<reachability_t> _reach;
+
+    // stream buffer that only counts what is written to it
+    struct counting_buf_t : std::streambuf {
+        size_t bytes = 0;
+
+        int overflow(int c) override {
+            ++bytes;
+            return c;
+        }
+
+        std::streamsize xsputn(const char*, std::streamsize n) override {
+            bytes += n;
+            return n;
+        }
+    };
+
+    // state-action pairs found uncovered during evaluation since the last report,
+    // together with the number of times each of them was hit
+    std::map<std::pair<qstate_t, size_t>, size_t> _uncovered_hits;
 public:
     // whether we are doing minimization or maximization
     bool _is_minimization = true;
     size_t _d_size = 0; // discrete state-vector size
     size_t _c_size = 0; // continuous state-vector size
     bool learning = true;
+    std::string _name; // set for learners allocated by UPPAAL, empty for clones
+    size_t _flushes = 0; // batches completed by this learner, for periodic reports
     
     //uncovered states
     //qtable_t uncovered;
@@ -112,24 +253,209 @@ public:
      * @return
      */
     qvalue_t best_value(double* d_vars, double* c_vars) {
-        auto state = make_state(d_vars, c_vars);
+        return best_value(make_state(d_vars, c_vars));
+    }
 
+    qvalue_t best_value(const qstate_t& state) {
         // lets try to find a matching state
-        auto it = _Q.find(state);
         qvalue_t best = {0, 0};
-        if (it != _Q.end()) {
-            auto& state_table = it->second;
-            for (auto& other : state_table) {
-                if (other.second._count == 0) continue;
-                if (best._count == 0)
-                    best = other.second;
-                if (_is_minimization && other.second._value < best._value)
-                    best = other.second;
-                else if (!_is_minimization && other.second._value > best._value)
-                    best = other.second;
+        for_each_action(state, [&](size_t, const qvalue_t& other) {
+            if (other._count == 0) return;
+            if (best._count == 0)
+                best = other;
+            if (_is_minimization && other._value < best._value)
+                best = other;
+            else if (!_is_minimization && other._value > best._value)
+                best = other;
+        });
+        return best;
+    }
+
+private:
+
+    static const size_t no_action = std::numeric_limits<size_t>::max();
+
+    /**
+     * Returns the action with the best sampled Q-value in the state (the lowest
+     * id among equally good ones), or no_action if none has been sampled.
+     */
+    size_t greedy_action(const qstate_t& state) {
+        size_t best_action = no_action;
+        double best = 0;
+        for_each_action(state, [&](size_t action, const qvalue_t& other) {
+            if (other._count == 0) return;
+            if (best_action == no_action
+                    || (_is_minimization && other._value < best)
+                    || (!_is_minimization && other._value > best)) {
+                best_action = action;
+                best = other._value;
             }
+        });
+        return best_action;
+    }
+
+    static qvalue_t from_entry(const SharedQTable::entry_t& entry) {
+        qvalue_t q;
+        q._value = entry.value;
+        q._count = entry.count;
+        return q;
+    }
+
+    /**
+     * Calls f(action, q) for each action of the state with a Q-value, in order
+     * of the actions. With a shared table (read in place) or a copy of it, the
+     * entries of _Q replace those of the table.
+     * @return whether the state is known
+     */
+    template <typename F>
+    bool for_each_action(const qstate_t& state, F&& f) {
+        auto it = _Q.find(state);
+        if (!_shared && !_base) {
+            if (it == _Q.end()) return false;
+            for (auto& action_value : it->second)
+                f(action_value.first, static_cast<const qvalue_t&> (action_value.second));
+            return true;
         }
-        return best;
+        const qaction_t* own = it != _Q.end() ? &it->second : nullptr;
+        qaction_t::const_iterator next;
+        if (own != nullptr) next = own->begin();
+        auto own_before = [&](size_t action) {
+            for (; own != nullptr && next != own->end() && next->first < action; ++next)
+                f(next->first, next->second);
+        };
+        auto base_entry = [&](size_t action, const qvalue_t& q) {
+            own_before(action);
+            if (own != nullptr && next != own->end() && next->first == action) {
+                f(action, next->second);
+                ++next;
+            } else {
+                f(action, q);
+            }
+        };
+        bool found = false;
+        if (_shared) {
+            found = _shared->read(state.first, state.second, [&](size_t action, const SharedQTable::entry_t& entry) {
+                base_entry(action, from_entry(entry));
+            });
+        } else {
+            auto in_base = _base->find(state);
+            found = in_base != _base->end();
+            if (found) {
+                for (auto& action_value : in_base->second) base_entry(action_value.first, action_value.second);
+            }
+        }
+        own_before(no_action);
+        return found || own != nullptr;
+    }
+
+    /**
+     * Calls f(state, action_map) for every state of the table, in key order
+     * (as save_table needs). With a shared table or a copy of it, the action
+     * map is assembled per state as in for_each_action.
+     */
+    template <typename F>
+    void for_each_state(F&& f) const {
+        if (!_shared && !_base) {
+            for (auto& state_action : _Q)
+                f(state_action.first, static_cast<const qaction_t&> (state_action.second));
+            return;
+        }
+        // a live shared table is copied first, to be walked in key order like _Q
+        std::shared_ptr<const qtable_t> base = _shared ? copy_shared() : _base;
+        // both tables are in key order, merge them
+        auto own = _Q.begin();
+        for (auto& state_action : *base) {
+            for (; own != _Q.end() && own->first < state_action.first; ++own)
+                f(own->first, static_cast<const qaction_t&> (own->second));
+            if (own != _Q.end() && own->first == state_action.first) {
+                qaction_t action_map = state_action.second;
+                for (auto& action_value : own->second) action_map[action_value.first] = action_value.second;
+                f(state_action.first, static_cast<const qaction_t&> (action_map));
+                ++own;
+            } else {
+                f(state_action.first, state_action.second);
+            }
+        }
+        for (; own != _Q.end(); ++own)
+            f(own->first, static_cast<const qaction_t&> (own->second));
+    }
+
+    /**
+     * Returns a copy of the current contents of the shared table.
+     */
+    std::shared_ptr<const qtable_t> copy_shared() const {
+        auto copy = std::make_shared<qtable_t>();
+        _shared->for_each([&](const double* key, const SharedQTable::entry_t* entries) {
+            auto& action_map = (*copy)[{std::vector<double>(key, key + _d_size),
+                    std::vector<double>(key + _d_size, key + _d_size + _c_size)}];
+            for (size_t a = 0; a < _shared->a_size(); ++a) {
+                if (entries[a].count != 0) action_map.emplace(a, from_entry(entries[a]));
+            }
+        });
+        return copy;
+    }
+
+    /**
+     * Calls f with the Q-value of the state-action pair to modify it, adding
+     * the pair first if needed. A learner with a copy of a shared table
+     * copies the entry from it into _Q first.
+     */
+    template <typename F>
+    void update(const qstate_t& state, size_t action, F&& f) {
+        if (_shared) {
+            _shared->update(state.first, state.second, action, [&](SharedQTable::entry_t& entry) {
+                qvalue_t q = from_entry(entry);
+                f(q);
+                entry.value = q._value;
+                entry.count = q._count;
+            });
+            return;
+        }
+        auto it = _Q.try_emplace(state).first;
+        auto ins = it->second.try_emplace(action);
+        qvalue_t& q = ins.first->second;
+        if (_base && ins.second) {
+            auto in_base = _base->find(state);
+            if (in_base != _base->end()) {
+                auto action_it = in_base->second.find(action);
+                if (action_it != in_base->second.end()) q = action_it->second;
+            }
+        }
+        f(q);
+        if (_checkpoint && !q._dirty) {
+            q._dirty = true;
+            _dirty.push_back({&it->first, action, &q});
+        }
+    }
+
+    static void to_record(size_t action, const qvalue_t& q, qrecord_t& record) {
+        record.action = action;
+        record.value = q._value;
+        record.count = q._count;
+        record.select = q._select;
+        record.uncover = q._uncover;
+    }
+
+    void restore_entry(const qrecord_t& record) {
+        qvalue_t& q = _Q[{record.d_vars, record.c_vars}][record.action];
+        q._value = record.value;
+        q._count = record.count;
+        q._select = record.select;
+        q._uncover = record.uncover;
+    }
+
+    void merge_entry(const qrecord_t& record) {
+        auto& action_map = _Q[{record.d_vars, record.c_vars}];
+        qvalue_t& q = action_map[record.action];
+        qrecord_t merged = record;
+        if (q._count != 0 || q._uncover) {
+            to_record(record.action, q, merged);
+            qrecord_merge(merged, record);
+        }
+        q._value = merged.value;
+        q._count = merged.count;
+        q._select = merged.select;
+        q._uncover = merged.uncover;
     }
 
 public:
@@ -159,31 +485,59 @@ public:
      */
 
     void add_sample(double* d_vars, double* c_vars, size_t action, double* t_d_vars, double* t_c_vars, double v_reward) {
-        const double gamma = 0.99; // discount, we could make it converge to zero by making this dependent on the number of samples seen for this state-action-pair
-        const double alpha = 2.0; // constant learning rate
         double reward = v_reward;
         auto from_state = make_state(d_vars, c_vars);
-        auto future_estimate = best_value(t_d_vars, t_c_vars);
-        qvalue_t& q = _Q[from_state][action];
-        const double learning_rate = 1.0 / std::min<double>(alpha, q._count + 1);
-        //const double learning_rate = 1.0/alpha;
-        assert(learning_rate <= 1.0);
-        assert(future_estimate._value == 0 || future_estimate._count != 0);
-        if (q._count == 0) {
-            // special case, we have no old value            
-            q._value = reward + gamma * future_estimate._value;
-        } else {
-            // standard Q-value update
-            q._value = q._value + (learning_rate * (reward + (gamma * future_estimate._value) - q._value));
-            //conservative Q-value
-            /*if(q.min_reward > v_reward)
-            {
-                q.min_reward = v_reward;
+        auto to_state = make_state(t_d_vars, t_c_vars);
+        auto future_estimate = best_value(to_state);
+        const size_t greedy_before = _telemetry ? greedy_action(from_state) : 0;
+        double old_value = 0, new_value = 0;
+        bool new_pair = false;
+        update(from_state, action, [&](qvalue_t& q) {
+            new_pair = q._count == 0;
+            old_value = q._value;
+            const double learning_rate = 1.0 / std::min<double>(alpha, q._count + 1);
+            //const double learning_rate = 1.0/alpha;
+            assert(learning_rate <= 1.0);
+            assert(future_estimate._value == 0 || future_estimate._count != 0);
+            if (q._count == 0) {
+                // special case, we have no old value            
+                q._value = reward + gamma * future_estimate._value;
+            } else {
+                // standard Q-value update
+                q._value = q._value + (learning_rate * (reward + (gamma * future_estimate._value) - q._value));
+                //conservative Q-value
+                /*if(q.min_reward > v_reward)
+                {
+                    q.min_reward = v_reward;
+                }
+                reward = q.min_reward;
+                q._value = q._value + reward + (gamma * future_estimate._value);*/
             }
-            reward = q.min_reward;
-            q._value = q._value + reward + (gamma * future_estimate._value);*/
+            q._count += 1;
+            new_value = q._value;
+        });
+        if (_telemetry) {
+            auto& t = *_telemetry;
+            ++t.samples;
+            if (new_pair) {
+                ++t.new_pairs;
+            } else {
+                const double change = std::abs(new_value - old_value);
+                ++t.updates;
+                t.sum_change += change;
+                t.max_change = std::max(t.max_change, change);
+            }
+            if (greedy_before != no_action && greedy_action(from_state) != greedy_before) ++t.flips;
+        }
+        if (_replay) {
+            _replay->store.add(from_state, action, reward, to_state);
+        }
+        if (_reach) {
+            auto from = _Q.find(from_state); // added by update
+            auto to = _Q.find(to_state);
+            _reach->add(&from->first, action,
+                    to != _Q.end() ? &to->first : &*_reach->outside.insert(to_state).first);
         }
-        q._count += 1;
     }
     
      /**
@@ -201,6 +555,63 @@ public:
         q._uncover = true;
     }
 
+    /**
+     * Records a hit on a state-action pair that is not covered by the strategy.
+     * Hits are deduplicated and only written out by @report_uncovered, so that
+     * evaluation does not pay for a stderr write per miss.
+     * @param d_vars discrete values of current state
+     * @param c_vars continuous values of current state
+     * @param action action used
+     */
+    void note_uncovered(double* d_vars, double* c_vars, size_t action) {
+        ++_uncovered_hits[{make_state(d_vars, c_vars), action}];
+    }
+
+    /**
+     * Writes the uncovered state-action pairs collected since the last report
+     * as one batch and forgets them.
+     * If the environment variable RLSTRATEGO_UNCOVERED_CSV names a file, the
+     * pairs are appended to it as CSV rows (d_0..,c_0..,action,count),
+     * otherwise they are written to stderr.
+     */
+    void report_uncovered() {
+        if (_uncovered_hits.empty()) return;
+        static const char* csv_path = std::getenv("RLSTRATEGO_UNCOVERED_CSV");
+        const bool csv = csv_path != nullptr && *csv_path != '\0';
+        std::ostringstream batch;
+        if (csv && !std::ifstream(csv_path).good()) {
+            // new file, start with a header
+            for (size_t d = 0; d < _d_size; ++d) batch << "d" << d << ",";
+            for (size_t c = 0; c < _c_size; ++c) batch << "c" << c << ",";
+            batch << "action,count\n";
+        }
+        for (auto& hit : _uncovered_hits) {
+            auto& state = hit.first.first;
+            if (csv) {
+                for (auto& d_value : state.first) batch << d_value << ",";
+                for (auto& c_value : state.second) batch << c_value << ",";
+                batch << hit.first.second << "," << hit.second << "\n";
+            } else {
+                batch << "State-action pair (<";
+                for (size_t d = 0; d < state.first.size(); ++d)
+                    batch << (d ? "," : "") << state.first[d];
+                batch << ">,[";
+                for (size_t c = 0; c < state.second.size(); ++c)
+                    batch << (c ? "," : "") << state.second[c];
+                batch << "]," << hit.first.second << ") is not found! (x" << hit.second << ")\n";
+            }
+        }
+        _uncovered_hits.clear();
+        auto data = batch.str();
+        if (csv) {
+            std::ofstream file(csv_path, std::ios::app);
+            file.write(data.data(), data.size());
+        } else {
+            std::cerr.write(data.data(), data.size());
+            std::cerr.flush();
+        }
+    }
+
     /**
      * Returns the statistics of the "mapped state", namely the range of the q-values 
      * (first constituents of return) and the total sum of samples seen (last 
@@ -211,22 +622,18 @@ public:
      */
     std::tuple<double, double, size_t, size_t> search_statistics(double* d_vars, double* c_vars) {
         auto state = make_state(d_vars, c_vars);
-        auto it = _Q.find(state);
         double lower = std::numeric_limits<double>::infinity();
         double upper = -std::numeric_limits<double>::infinity();
         size_t sum_count = 0;
         size_t n_actions = 0;
-        if (it != _Q.end()) {
-            auto& state_table = it->second;
-            for (auto& stats : state_table) {
-                if (stats.second._count != 0) {
-                    sum_count += stats.second._count;
-                    lower = std::min(lower, stats.second._value);
-                    upper = std::max(upper, stats.second._value);
-                    ++n_actions;
-                }
+        for_each_action(state, [&](size_t, const qvalue_t& stats) {
+            if (stats._count != 0) {
+                sum_count += stats._count;
+                lower = std::min(lower, stats._value);
+                upper = std::max(upper, stats._value);
+                ++n_actions;
             }
-        }
+        });
         return {lower, upper, sum_count, n_actions};
     }
 
@@ -240,33 +647,18 @@ public:
      * @return
      */
     qvalue_t value(double* d_vars, double* c_vars, size_t action) {
-        auto state = make_state(d_vars, c_vars);
+        return value(make_state(d_vars, c_vars), action);
+    }
 
-        // lets try to find a matching state
-        auto it = _Q.find(state);
-        if (it != _Q.end()) {
-            // we have observed this state before
-            auto& state_table = it->second;
-            auto action_it = state_table.find(action);
-            if (action_it != state_table.end()) {
-                // we have observations for this action, return the computed Q-value
-                return action_it->second;
-            } else {
-                // No prior observation of the action, we need a default value.
-                return {0, 0};
-                //                if (_is_minimization)
-                //                    return {min, 0};
-                //                else
-                //                    return {max, 0};
-            }
-        } else {
-            // No prior observation of the state, we need a default value.
-            return {0, 0};
-            //            if (_is_minimization)
-            //                return {min, 0};
-            //            else
-            //                return {max, 0};
-        }
+    qvalue_t value(const qstate_t& state, size_t action) {
+        // lets try to find a matching state; without a prior observation of
+        // the state or the action, the default value is {0, 0}
+        qvalue_t result = {0, 0};
+        for_each_action(state, [&](size_t other, const qvalue_t& q) {
+            // we have observations for this action, return the computed Q-value
+            if (other == action) result = q;
+        });
+        return result;
     }
 
     /**
@@ -276,12 +668,14 @@ public:
      * @param d_vars
      * @param c_vars
      * @param action
+     * @param uncovered if given, set to whether the pair is marked uncovered
      * @return
      */
-    bool is_allowed(double* d_vars, double* c_vars, size_t action, bool* found) {
+    bool is_allowed(double* d_vars, double* c_vars, size_t action, bool* found, bool* uncovered = nullptr) {
         *found = true;
         qvalue_t current_v = value(d_vars, c_vars, action);
         qvalue_t best_v = best_value(d_vars, c_vars);
+        if (uncovered != nullptr) *uncovered = current_v._uncover;
 
         assert(current_v._count == 0 || best_v._count != 0);
         
@@ -304,7 +698,146 @@ public:
         return false;
     }
 
+    /**
+     * Writes a report on the memory used by the Q-table: the bytes taken by
+     * each component of _Q (tree nodes of the state map, heap storage of the
+     * state vectors, tree nodes of the action maps), the part of it held by
+     * cold states (no action sampled more than once), and histograms of the
+     * visit counts, of the number of actions per state and of the number of
+     * distinct values per state dimension after truncation in make_state.
+     *
+     * Payload bytes are exact for libstdc++; "allocated" adds the per-chunk
+     * overhead and rounding of glibc malloc and is an estimate.
+     * @param out - the output stream to write to.
+     * @param reason - what triggered the report
+     */
+    void memory_report(std::ostream& out, const char* reason) {
+        using state_node_t = std::_Rb_tree_node<qtable_t::value_type>;
+        using action_node_t = std::_Rb_tree_node<qaction_t::value_type>;
+        // glibc malloc: 8 bytes of header, 16-byte granularity, 32 bytes at least
+        auto allocated = [](size_t bytes) -> size_t {
+            return bytes == 0 ? 0 : std::max<size_t>(32, (bytes + 8 + 15) & ~size_t(15));
+        };
+        struct component_t {
+            size_t count = 0, payload = 0, allocated = 0;
+        };
+        component_t state_nodes, d_vectors, c_vectors, action_nodes, cold;
+        std::map<size_t, size_t> visits; // power-of-two bucket of _count -> pairs
+        std::map<size_t, size_t> actions_per_state;
+        std::vector<std::set<double>> d_values(_d_size), c_values(_c_size);
+
+        for (auto& state_action : _Q) {
+            auto& state = state_action.first;
+            auto& action_map = state_action.second;
+            size_t state_payload = sizeof (state_node_t);
+            size_t state_allocated = allocated(sizeof (state_node_t));
+            ++state_nodes.count;
+            state_nodes.payload += sizeof (state_node_t);
+            state_nodes.allocated += allocated(sizeof (state_node_t));
+            size_t d_bytes = state.first.capacity() * sizeof (double);
+            size_t c_bytes = state.second.capacity() * sizeof (double);
+            d_vectors.count += d_bytes != 0;
+            d_vectors.payload += d_bytes;
+            d_vectors.allocated += allocated(d_bytes);
+            c_vectors.count += c_bytes != 0;
+            c_vectors.payload += c_bytes;
+            c_vectors.allocated += allocated(c_bytes);
+            state_payload += d_bytes + c_bytes + action_map.size() * sizeof (action_node_t);
+            state_allocated += allocated(d_bytes) + allocated(c_bytes)
+                    + action_map.size() * allocated(sizeof (action_node_t));
+            action_nodes.count += action_map.size();
+            action_nodes.payload += action_map.size() * sizeof (action_node_t);
+            action_nodes.allocated += action_map.size() * allocated(sizeof (action_node_t));
+            ++actions_per_state[action_map.size()];
+
+            bool is_cold = true;
+            for (auto& action_value : action_map) {
+                size_t n = action_value.second._count;
+                size_t bucket = 0;
+                while ((size_t(1) << bucket) <= n / 2 && bucket < 63) ++bucket; // 2^bucket <= n < 2^(bucket+1)
+                ++visits[n == 0 ? 0 : bucket + 1];
+                if (n > 1) is_cold = false;
+            }
+            if (is_cold) {
+                ++cold.count;
+                cold.payload += state_payload;
+                cold.allocated += state_allocated;
+            }
+            for (size_t d = 0; d < state.first.size() && d < _d_size; ++d) d_values[d].insert(state.first[d]);
+            for (size_t c = 0; c < state.second.size() && c < _c_size; ++c) c_values[c].insert(state.second[c]);
+        }
+
+        std::ostringstream report;
+        auto row = [&](const char* name, const component_t& c) {
+            report << "  " << std::left << std::setw(22) << name << std::right
+                    << std::setw(12) << c.count << std::setw(16) << c.payload
+                    << std::setw(16) << c.allocated << "\n";
+        };
+        component_t total;
+        for (auto* c : {&state_nodes, &d_vectors, &c_vectors, &action_nodes}) {
+            total.payload += c->payload;
+            total.allocated += c->allocated;
+        }
+        total.count = state_nodes.count;
+        report << "Q-table memory report" << (_name.empty() ? "" : " for learner " + _name)
+                << " (" << reason << ")\n";
+        report << "  " << std::left << std::setw(22) << "component" << std::right
+                << std::setw(12) << "count" << std::setw(16) << "payload bytes"
+                << std::setw(16) << "allocated" << "\n";
+        row("state map nodes", state_nodes);
+        row("discrete vectors", d_vectors);
+        row("continuous vectors", c_vectors);
+        row("action map nodes", action_nodes);
+        row("total", total);
+        row("cold states", cold);
+        if (_shared) {
+            report << "  shared table: " << _shared->size() << " of " << _shared->capacity()
+                    << " slots used, " << _shared->region_size() << " bytes mapped\n";
+        }
+        if (_base) {
+            report << "  copy of the shared table: " << _base->size() << " states, used by "
+                    << _base.use_count() << " learners\n";
+        }
+        report << "  visits per state-action pair:\n";
+        for (auto& bucket : visits) {
+            report << "    ";
+            if (bucket.first == 0) report << "0";
+            else if (bucket.first == 1) report << "1";
+            else report << (size_t(1) << (bucket.first - 1)) << "-" << (size_t(1) << bucket.first) - 1;
+            report << ": " << bucket.second << "\n";
+        }
+        report << "  actions per state:\n";
+        for (auto& bucket : actions_per_state) {
+            report << "    " << bucket.first << ": " << bucket.second << "\n";
+        }
+        report << "  distinct values per dimension:\n";
+        auto dimension = [&](const char* kind, size_t i, const std::set<double>& values) {
+            report << "    " << kind << i << ": " << values.size();
+            if (!values.empty()) report << " in [" << *values.begin() << ", " << *values.rbegin() << "]";
+            report << "\n";
+        };
+        for (size_t d = 0; d < _d_size; ++d) dimension("d", d, d_values[d]);
+        for (size_t c = 0; c < _c_size; ++c) dimension("c", c, c_values[c]);
+        auto data = report.str();
+        out.write(data.data(), data.size());
+        out.flush();
+    }
+
     int length() {
+        if (_shared) {
+            size_t n = _shared->size();
+            for (auto& state_action : _Q) {
+                // states only known to this learner, e.g. found uncovered during evaluation
+                if (!_shared->read(state_action.first.first, state_action.first.second,
+                        [](size_t, const SharedQTable::entry_t&) {})) ++n;
+            }
+            return n;
+        }
+        if (_base) {
+            size_t n = _base->size();
+            for (auto& state_action : _Q) n += _base->count(state_action.first) == 0;
+            return n;
+        }
         if (&_Q != nullptr) return _Q.size();
         else return 0;
     }
@@ -315,40 +848,435 @@ public:
     
     void clear_strategy() {
         _Q.clear();
+        _dirty.clear();
+        _shared.reset(); // leave the shared table to the other processes
+        _base.reset();
+        if (_reach) _reach = std::make_shared<reachability_t>();
+    }
+
+    /**
+     * Learns into the shared table at path (see shared_qtable.h) instead of a
+     * private one, until learning ends or the learner is cloned (see freeze).
+     * @param path file backing the table, e.g. under /dev/shm
+     * @param a_size number of actions of the model
+     * @param capacity number of states the table has room for, if it is created
+     * @return false (the learner keeps its private table) if the table cannot be used
+     */
+    bool attach_shared(const std::string& path, size_t a_size, size_t capacity) {
+        SharedQTable* table = SharedQTable::open(path, _is_minimization, _d_size, _c_size, a_size, capacity);
+        if (table == nullptr) return false;
+        _shared.reset(table);
+        return true;
+    }
+
+    /**
+     * Replaces the shared table by a copy of its current contents, so that the
+     * strategy no longer changes with the learning of other processes. Done
+     * when learning ends, which makes the strategy evaluated the one exported,
+     * and for clones, which are snapshots. The copy is shared by the clones
+     * made afterwards; later updates are copied on write into _Q.
+     */
+    void freeze() {
+        if (!_shared) return;
+        _base = copy_shared();
+        _shared.reset();
+    }
+
+    /**
+     * Starts writing incremental checkpoints into dir (see checkpoint.h), one
+     * per call to checkpoint.
+     * @return false if checkpoints are not available for this learner
+     */
+    bool enable_checkpoints(const std::string& dir) {
+        if (_shared) {
+            std::cerr << "Checkpoints are not available for a shared Q-table\n";
+            return false;
+        }
+        _checkpoint = std::make_shared<CheckpointWriter>(dir, _d_size, _c_size);
+        for (auto& state_action : _Q) {
+            // whatever is already known goes into the base checkpoint
+            for (auto& action_value : state_action.second) {
+                action_value.second._dirty = true;
+                _dirty.push_back({&state_action.first, action_value.first, &action_value.second});
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Stops writing checkpoints, e.g. for a clone which must not write into
+     * the directory of the learner it was copied from.
+     */
+    void disable_checkpoints() {
+        _checkpoint.reset();
+        _dirty.clear();
+    }
+
+    /**
+     * Hands the entries changed since the last checkpoint to the checkpoint
+     * writer. Only the changed entries are copied here; formatting and
+     * writing the file happen on the writer's thread.
+     */
+    void checkpoint() {
+        if (!_checkpoint || _dirty.empty()) return;
+        std::vector<qrecord_t> records(_dirty.size());
+        for (size_t i = 0; i < _dirty.size(); ++i) {
+            auto& dirty = _dirty[i];
+            records[i].d_vars = dirty.state->first;
+            records[i].c_vars = dirty.state->second;
+            to_record(dirty.action, *dirty.q, records[i]);
+            const_cast<qvalue_t*> (dirty.q)->_dirty = false;
+        }
+        _dirty.clear();
+        _checkpoint->submit(std::move(records));
+    }
+
+    /**
+     * Rebuilds the table from the checkpoints in dir: the base checkpoint
+     * followed by every delta up to the first missing one (see
+     * CheckpointWriter::checkpoint_files), later entries replacing earlier ones.
+     * @return false if dir holds no checkpoint or one of them cannot be read
+     */
+    bool load_checkpoint(const std::string& dir) {
+        auto files = CheckpointWriter::checkpoint_files(dir);
+        if (files.empty()) return false;
+        for (auto& file : files) {
+            std::ifstream in(file);
+            size_t d_size = 0, c_size = 0;
+            if (!read_qtable_header(in, d_size, c_size) || d_size != _d_size || c_size != _c_size)
+                return false;
+            qrecord_t record;
+            while (read_qrecord(in, _d_size, _c_size, record)) {
+                restore_entry(record);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Starts logging convergence statistics at every flush (see
+     * report_convergence) by appending CSV rows to the file at path.
+     * @param path log file
+     * @param learner name of this learner in the log
+     * @param epsilon largest Q-value change of a batch considered insignificant
+     * @param patience number of consecutive insignificant batches until convergence is signalled
+     */
+    void enable_telemetry(const std::string& path, const std::string& learner, double epsilon, size_t patience) {
+        auto t = std::make_shared<telemetry_t>();
+        const bool new_log = !std::ifstream(path).good();
+        t->log.open(path, std::ios::app);
+        if (!t->log) {
+            std::cerr << "Cannot write convergence log " << path << "\n";
+            return;
+        }
+        if (new_log)
+            t->log << "learner,batch,samples,max_change,mean_change,new_states,new_pairs,greedy_flips,"
+                "replay_backups,replay_max_change,replay_flips,converged\n";
+        t->path = path;
+        t->learner = learner;
+        t->epsilon = epsilon;
+        t->patience = std::max<size_t>(patience, 1);
+        t->last_length = length();
+        _telemetry = t;
+    }
+
+    /**
+     * Ends the current batch of convergence statistics: logs the largest and
+     * mean absolute change of the Q-values updated in the batch, the number of
+     * new states and state-action pairs, and the number of samples that changed
+     * the greedy action of their state; then the same for the backups made by
+     * replay, if enabled (call replay first).
+     * Learning is considered converged after `patience` consecutive batches
+     * with samples, no new states, no greedy flips and no change above
+     * `epsilon`, by samples or by replay. This is signalled once on stderr and by creating the file
+     * "<log>.<learner>.converged", one per learner as several learners (e.g.
+     * for minimization and maximization) may share a log; scripts can poll
+     * for the files of all their learners to stop learning early.
+     */
+    void report_convergence() {
+        if (!_telemetry || !learning) return;
+        auto& t = *_telemetry;
+        const size_t current_length = length();
+        const size_t new_states = current_length > t.last_length ? current_length - t.last_length : 0;
+        const double mean_change = t.updates != 0 ? t.sum_change / t.updates : 0;
+        const bool quiet = t.samples != 0 && new_states == 0 && t.flips == 0 && t.max_change <= t.epsilon
+                && t.replay_flips == 0 && t.replay_max_change <= t.epsilon;
+        t.quiet_batches = quiet ? t.quiet_batches + 1 : 0;
+        const bool converged = t.quiet_batches >= t.patience;
+        t.log << t.learner << "," << t.batch << "," << t.samples << "," << t.max_change << ","
+                << mean_change << "," << new_states << "," << t.new_pairs << "," << t.flips << ","
+                << t.replay_backups << "," << t.replay_max_change << "," << t.replay_flips << ","
+                << converged << "\n";
+        t.log.flush();
+        if (converged && !t.converged) {
+            std::cerr << "Q-values of learner " << t.learner << " converged after batch " << t.batch << "\n";
+            std::ofstream(t.path + "." + t.learner + ".converged") << t.batch << "\n";
+        }
+        t.converged = converged;
+        ++t.batch;
+        t.last_length = current_length;
+        t.samples = t.updates = t.new_pairs = t.flips = 0;
+        t.max_change = t.sum_change = 0;
+        t.replay_backups = t.replay_flips = 0;
+        t.replay_max_change = 0;
+    }
+
+    /**
+     * Starts storing the transitions seen by add_sample (at most capacity of
+     * them) for prioritized sweeping at every flush, see replay.
+     * @param capacity number of transitions kept
+     * @param budget number of backups per flush
+     * @param threshold smallest Bellman error worth a backup
+     */
+    void enable_replay(size_t capacity, size_t budget, double threshold) {
+        _replay = std::make_shared<replay_t>(capacity, budget, threshold);
+    }
+
+    /**
+     * Prioritized sweeping over the stored transitions: the transitions
+     * sampled since the last call are queued by the size of their Bellman
+     * error |reward + gamma * V(successor) - Q(state, action)|, and the
+     * transition with the largest error is backed up first. Whenever a
+     * backup changes the best value V of a state, the stored transitions
+     * leading into that state are queued as well, so the change propagates
+     * to predecessors without new simulation runs. Stops after the budget
+     * of backups or when no error exceeds the threshold.
+     *
+     * Backups use the learning rate of add_sample for repeated samples and
+     * do not count as samples; with telemetry, their number, largest change
+     * and greedy flips are logged in the columns of replay.
+     * @return number of backups made
+     */
+    size_t replay() {
+        if (!_replay || !learning) return 0;
+        auto& store = _replay->store;
+        const double learning_rate = 1.0 / alpha;
+        auto bellman_error = [&](size_t slot) {
+            auto& t = store[slot];
+            qvalue_t q = value(*t.from, t.action);
+            if (q._count == 0) return 0.0; // not (or no longer) in the table
+            return t.reward + gamma * best_value(*t.to)._value - q._value;
+        };
+
+        std::priority_queue<std::pair<double, size_t>> queue;
+        for (size_t slot : store.take_recent()) {
+            double error = std::abs(bellman_error(slot));
+            if (error > _replay->threshold) queue.push({error, slot});
+        }
+        size_t backups = 0;
+        while (!queue.empty() && backups < _replay->budget) {
+            size_t slot = queue.top().second;
+            queue.pop();
+            // priorities may be stale, the table changed since the slot was queued
+            double error = bellman_error(slot);
+            if (std::abs(error) <= _replay->threshold) continue;
+            auto& t = store[slot];
+            double before = best_value(*t.from)._value;
+            const size_t greedy_before = _telemetry ? greedy_action(*t.from) : 0;
+            update(*t.from, t.action, [&](qvalue_t& q) {
+                q._value += learning_rate * error;
+            });
+            ++backups;
+            if (_telemetry) {
+                auto& telemetry = *_telemetry;
+                ++telemetry.replay_backups;
+                telemetry.replay_max_change = std::max(telemetry.replay_max_change, std::abs(learning_rate * error));
+                if (greedy_action(*t.from) != greedy_before) ++telemetry.replay_flips;
+            }
+            if (best_value(*t.from)._value == before) continue;
+            for (size_t pred : store.predecessors(t.from)) {
+                double pred_error = std::abs(bellman_error(pred));
+                if (pred_error > _replay->threshold) queue.push({pred_error, pred});
+            }
+        }
+        return backups;
+    }
+
+    /**
+     * Starts recording the successor graph of the samples, so that
+     * print_complete_score_table exports only the states reachable under
+     * the learned strategy (see reachable_states). The graph refers to the
+     * nodes of _Q; on top of the table it takes a map node per sampled
+     * state-action pair and a pointer per distinct successor.
+     * @return false if pruning is not available for this learner
+     */
+    bool enable_pruning() {
+        if (_shared) {
+            std::cerr << "Pruning is not available for a shared Q-table\n";
+            return false;
+        }
+        _reach = std::make_shared<reachability_t>();
+        return true;
     }
+
+    /**
+     * Ends the current batch of samples for the successor graph.
+     */
+    void end_trace_batch() {
+        if (_reach) _reach->end_batch();
+    }
+
+    /**
+     * Collects the states reachable from the initial states of the sampled
+     * traces when only the actions allowed by the strategy (see is_allowed:
+     * sampled actions with the best value) are taken, following the
+     * transitions observed during learning.
+     * @return false if no successor graph is available
+     */
+    bool reachable_states(std::set<const qstate_t*>& reached) {
+        if (!_reach) return false;
+        _reach->end_batch();
+        if (_reach->initial.empty()) return false;
+        std::vector<const qstate_t*> stack(_reach->initial.begin(), _reach->initial.end());
+        reached.insert(_reach->initial.begin(), _reach->initial.end());
+        while (!stack.empty()) {
+            const qstate_t* state = stack.back();
+            stack.pop_back();
+            auto it = _reach->outside.find(*state);
+            if (it != _reach->outside.end() && &*it == state) {
+                // continue from its node in _Q, if it was sampled as an origin later on
+                auto in_table = _Q.find(*state);
+                if (in_table == _Q.end() || !reached.insert(&in_table->first).second) continue;
+                state = &in_table->first;
+            }
+            auto best = best_value(*state);
+            if (best._count == 0) continue; // never left this state while learning
+            for_each_action(*state, [&](size_t action, const qvalue_t& q) {
+                if (q._uncover || q._count == 0 || q._value != best._value) return;
+                auto edges = _reach->successors.find({state, action});
+                if (edges == _reach->successors.end()) return;
+                for (const qstate_t* next : edges->second) {
+                    if (reached.insert(next).second) stack.push_back(next);
+                }
+            });
+        }
+        return true;
+    }
+
+    /**
+     * Turns a copy of a learner into an independent snapshot: it gets a copy of
+     * a shared table (see freeze), neither writes checkpoints nor convergence
+     * statistics, and records its own successor graph.
+     */
+    void make_snapshot() {
+        freeze();
+        disable_checkpoints();
+        _telemetry.reset();
+        _replay.reset();
+        _uncovered_hits.clear(); // reported by the learner they were noted on
+        if (_reach) _reach = _reach->copy_for(_Q); // the original refers to the nodes of the other _Q
+        _name.clear();
+        _flushes = 0;
+    }
+
     
+    /**
+     * Writes the whole table, including visit counts and flags, in the format
+     * of qtable_io.h (see merge_qtable_files for combining several of them).
+     * @param out - the output stream to write to.
+     */
+    void save_table(std::ostream& out) {
+        write_qtable_header(out, _d_size, _c_size);
+        qrecord_t record;
+        for_each_state([&](const qstate_t& state, const qaction_t& action_map) {
+            record.d_vars = state.first;
+            record.c_vars = state.second;
+            for (auto& action_value : action_map) {
+                to_record(action_value.first, action_value.second, record);
+                write_qrecord(out, record);
+            }
+        });
+    }
+
+    /**
+     * Adds the entries of a saved table to this one. Entries present in both
+     * are combined as by qrecord_merge.
+     * @param in - the input stream to read a table from.
+     * @return false if the input is not a table with the sizes of this learner
+     */
+    bool load_table(std::istream& in) {
+        size_t d_size = 0, c_size = 0;
+        if (!read_qtable_header(in, d_size, c_size) || d_size != _d_size || c_size != _c_size)
+            return false;
+        qrecord_t record;
+        while (read_qrecord(in, _d_size, _c_size, record)) {
+            merge_entry(record);
+        }
+        in.clear();
+        in >> std::ws;
+        return in.eof();
+    }
+
+    /**
+     * Adds the entries of another learner (e.g. one trained in a separate
+     * process) to this one. Entries present in both are combined as by qrecord_merge.
+     * @param other
+     */
+    void merge(const QLearner& other) {
+        assert(other._d_size == _d_size && other._c_size == _c_size);
+        qrecord_t record;
+        other.for_each_state([&](const qstate_t& state, const qaction_t& action_map) {
+            record.d_vars = state.first;
+            record.c_vars = state.second;
+            for (auto& action_value : action_map) {
+                to_record(action_value.first, action_value.second, record);
+                merge_entry(record);
+            }
+        });
+    }
+
+    /**
+     * Outputs every state of the table, or, if pruning is enabled, only those
+     * reachable under the learned strategy (see reachable_states). The number
+     * of states and bytes pruned away is reported on stderr.
+     * @param out - the output stream to write to.
+     */
     void print_complete_score_table(std::ostream& out) {
         bool first = true;
+        std::set<const qstate_t*> reached;
+        const bool prune = reachable_states(reached);
+        counting_buf_t pruned_bytes;
+        std::ostream pruned_out(&pruned_bytes);
+        size_t pruned = 0;
+        size_t states = 0;
         out << "{\n";
-        for (auto& state_action : _Q) {
-            auto& state = state_action.first;
-            auto& action_map = state_action.second;
+        for_each_state([&](const qstate_t& state, const qaction_t& action_map) {
+            ++states;
+            bool keep = true;
+            if (prune) keep = reached.count(&state) != 0;
+            // pruned states are only written to count the bytes saved
+            std::ostream& entry = keep ? out : pruned_out;
+            if (!keep) ++pruned;
 
-            if (!first) out << ",\n"; // make json-friendly
-            first = false;
-            out << "\"(";
+            if (!first || !keep) entry << ",\n"; // make json-friendly
+            if (keep) first = false;
+            entry << "\"(";
             // iterate over discrete state values
             for (auto& d_value : state.first) {
-                out << d_value << ",";
+                entry << d_value << ",";
             }
-            out << "),[";
+            entry << "),[";
             // iterate over concrete/continuous state values
             for (auto& c_value : state.second) {
-                out << c_value << ",";
+                entry << c_value << ",";
             }
-            out << "]\":{";
+            entry << "]\":{";
             bool first_action = true;
             for (auto& action_value : action_map) {
-                if (!first_action) out << ",";
+                if (!first_action) entry << ",";
                 first_action = false;
-                out << "\n\t";
+                entry << "\n\t";
                 //action_value.first is the action ID.
                 //action_value.second is the value of the state-action pair, and the count of it.
-                out << "\"" << action_value.first << "\":" << action_value.second._value;
+                entry << "\"" << action_value.first << "\":" << action_value.second._value;
             }
-            out << "}";
-        }
+            entry << "}";
+        });
         out << "\n}";
+        if (prune) {
+            std::cerr << "Pruned " << pruned << " of " << states
+                    << " states unreachable under the learned strategy (" << pruned_bytes.bytes << " bytes)\n";
+        }
     }
 
     void print_partial_score_table(std::ostream& out, bool compact, bool uncovered) {
@@ -405,6 +1333,121 @@ public:
         out << "\n}";
     }
         
+    /**
+     * Outputs the uncovered cells like print_partial_score_table(out, false, true),
+     * but merges adjacent cells with the same discrete part and the same set of
+     * uncovered actions into hyper-rectangles. A continuous dimension of a region
+     * is written as "lower:upper" (inclusive), or as a single value when the
+     * region is one cell wide in that dimension.
+     *
+     * The merge is a sort-and-sweep, one pass per continuous dimension: regions
+     * are sorted so that candidates for merging along dimension k become
+     * neighbours, and runs of regions that touch along k are joined. Cells are
+     * the truncated (integral) values of make_state, so two regions touch when
+     * the upper bound of one is one below the lower bound of the other.
+     * @param out - the output stream to write to.
+     */
+    void print_uncovered_regions(std::ostream& out) {
+        using group_t = std::pair<std::vector<double>, std::vector<size_t>>;
+        const size_t dims = _c_size;
+        const size_t stride = 2 * dims;
+
+        // group cells by their discrete part and uncovered action set
+        std::map<group_t, size_t> group_ids;
+        std::vector<const group_t*> groups;
+        std::vector<size_t> group; // group id per region
+        std::vector<double> bounds; // [lower_0, upper_0, lower_1, upper_1, ..] per region
+        for (auto& state_action : _Q) {
+            auto& state = state_action.first;
+            std::vector<size_t> actions;
+            for (auto& action_value : state_action.second) {
+                if (action_value.second._uncover) actions.push_back(action_value.first);
+            }
+            if (actions.empty() || state.second.size() != dims) continue;
+            auto ins = group_ids.emplace(group_t{state.first, std::move(actions)}, groups.size());
+            if (ins.second) groups.push_back(&ins.first->first);
+            group.push_back(ins.first->second);
+            for (auto& c_value : state.second) {
+                bounds.push_back(c_value);
+                bounds.push_back(c_value);
+            }
+        }
+        const size_t cells = group.size();
+
+        std::vector<size_t> order;
+        for (size_t k = 0; k < dims; ++k) {
+            const size_t n = group.size();
+            order.resize(n);
+            for (size_t i = 0; i < n; ++i) order[i] = i;
+            // sort by group, then by the bounds of all other dimensions, then by the lower bound in k
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+                if (group[a] != group[b]) return group[a] < group[b];
+                const double* ba = &bounds[a * stride];
+                const double* bb = &bounds[b * stride];
+                for (size_t j = 0; j < stride; ++j) {
+                    if (j / 2 == k || ba[j] == bb[j]) continue;
+                    return ba[j] < bb[j];
+                }
+                return ba[2 * k] < bb[2 * k];
+            });
+            // sweep, joining runs that touch along k
+            std::vector<size_t> merged_group;
+            std::vector<double> merged_bounds;
+            merged_group.reserve(n);
+            merged_bounds.reserve(n * stride);
+            for (size_t i = 0; i < n; ++i) {
+                const size_t r = order[i];
+                const double* br = &bounds[r * stride];
+                if (!merged_group.empty() && merged_group.back() == group[r]) {
+                    double* last = &merged_bounds[merged_bounds.size() - stride];
+                    bool same = true;
+                    for (size_t j = 0; j < stride && same; ++j) {
+                        if (j / 2 != k) same = last[j] == br[j];
+                    }
+                    if (same && br[2 * k] <= last[2 * k + 1] + 1) {
+                        last[2 * k + 1] = std::max(last[2 * k + 1], br[2 * k + 1]);
+                        continue;
+                    }
+                }
+                merged_group.push_back(group[r]);
+                merged_bounds.insert(merged_bounds.end(), br, br + stride);
+            }
+            group.swap(merged_group);
+            bounds.swap(merged_bounds);
+        }
+
+        bool first = true;
+        out << "{\n";
+        // the last sweep leaves the regions ordered by group
+        for (size_t r = 0; r < group.size(); ++r) {
+            auto& key = *groups[group[r]];
+            const double* br = bounds.data() + r * stride;
+            if (!first) out << ",\n"; // make json-friendly
+            first = false;
+            out << "\"(";
+            for (auto& d_value : key.first) {
+                out << d_value << ",";
+            }
+            out << "),[";
+            for (size_t k = 0; k < dims; ++k) {
+                out << br[2 * k];
+                if (br[2 * k + 1] != br[2 * k]) out << ":" << br[2 * k + 1];
+                out << ",";
+            }
+            out << "]\":{";
+            bool first_action = true;
+            for (auto& action : key.second) {
+                if (!first_action) out << ",";
+                first_action = false;
+                out << "\n\t";
+                out << "\"" << action << "\":" << min_reward;
+            }
+            out << "}";
+        }
+        out << "\n}";
+        std::cerr << "Merged " << cells << " uncovered cells into " << group.size() << " regions\n";
+    }
+
     /**
      * Outputs the learned q-values to the string-stream in a json-friendly format
      * of a map over "(discrete,continuous)"-state variable vector pairs and
@@ -414,6 +1457,7 @@ public:
     void print(std::ostream& out = std::cerr) {
         if (learning) {
             learning = false;
+            freeze(); // evaluate and export the shared table as of now
             this->print_complete_score_table(out);
         } else {
             #if defined(COMPACT) && !defined(CEG) 
@@ -423,9 +1467,12 @@ public:
                 this->print_partial_score_table(out, true, false);
             #endif
             
-            #if defined(CEG) 
+            #if defined(CEG) && !defined(REGION_EXPORT)
                 this->print_partial_score_table(out, false, true);
             #endif
+            #if defined(CEG) && defined(REGION_EXPORT)
+                this->print_uncovered_regions(out);
+            #endif
         }
     }
 
@@ -435,14 +1482,13 @@ public:
         if (is_allowed(d_vars, c_vars, action, &found)) {
             auto state = make_state(d_vars, c_vars);
             auto it = _Q.find(state);
-            if (it != _Q.end()) {
-                auto& state_table = it->second;
-                auto action_it = state_table.find(action);
-
-                if (action_it != state_table.end()) {
-                    action_it->second._select = true;
-                } else {
-                }
+            if (it != _Q.end() && it->second.count(action) != 0) {
+                it->second[action]._select = true;
+            } else if (_base) {
+                // the pair is only in the copy of the shared table, take a copy to mark
+                update(state, action, [](qvalue_t& q) {
+                    q._select = true;
+                });
             }
 
         } else {
@@ -0,0 +1,191 @@
+/* 
+ * File:   qtable_io.h
+ *
+ * Plain-text format for saving, merging and restoring learned Q-tables.
+ *
+ * A table file starts with the header line "qtable <d_size> <c_size>" followed
+ * by one line per state-action pair:
+ *
+ *     d_0 .. d_{d_size-1} c_0 .. c_{c_size-1} action value count select uncover
+ *
+ * Lines are ordered by (discrete, continuous, action) exactly like the
+ * std::map in QLearner, so several files can be merged in one streaming pass.
+ */
+
+#ifndef QTABLE_IO_H
+#define QTABLE_IO_H
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <queue>
+#include <string>
+#include <vector>
+
+/**
+ * One state-action pair of a saved Q-table
+ */
+struct qrecord_t {
+    std::vector<double> d_vars;
+    std::vector<double> c_vars;
+    size_t action = 0;
+    double value = 0;
+    size_t count = 0;
+    bool select = false;
+    bool uncover = false;
+};
+
+/**
+ * Orders records by (discrete, continuous, action), the order of QLearner's table.
+ */
+inline bool qrecord_less(const qrecord_t& a, const qrecord_t& b) {
+    if (a.d_vars != b.d_vars) return a.d_vars < b.d_vars;
+    if (a.c_vars != b.c_vars) return a.c_vars < b.c_vars;
+    return a.action < b.action;
+}
+
+inline bool qrecord_same_key(const qrecord_t& a, const qrecord_t& b) {
+    return a.action == b.action && a.d_vars == b.d_vars && a.c_vars == b.c_vars;
+}
+
+/**
+ * Combines the observations of other into into.
+ * Sampled values are averaged weighted by their counts. An uncovered entry is
+ * a placeholder (see QLearner::add_uncovered), so it only survives if no input
+ * has samples for the pair. A pair is selected if it is selected in any input.
+ */
+inline void qrecord_merge(qrecord_t& into, const qrecord_t& other) {
+    if (into.uncover && !other.uncover) {
+        into.value = other.value;
+        into.count = other.count;
+        into.uncover = false;
+    } else if (!into.uncover && !other.uncover) {
+        size_t total = into.count + other.count;
+        if (total != 0)
+            into.value = (into.value * into.count + other.value * other.count) / total;
+        into.count = total;
+    }
+    into.select = into.select || other.select;
+}
+
+inline void write_qtable_header(std::ostream& out, size_t d_size, size_t c_size) {
+    out << "qtable " << d_size << " " << c_size << "\n";
+}
+
+/**
+ * Reads the header line of a table file.
+ * @return false if the stream does not start with a table header
+ */
+inline bool read_qtable_header(std::istream& in, size_t& d_size, size_t& c_size) {
+    std::string magic;
+    return (in >> magic >> d_size >> c_size) && magic == "qtable";
+}
+
+inline void write_qrecord(std::ostream& out, const qrecord_t& r) {
+    // enough digits for values to survive the round-trip exactly
+    out << std::setprecision(std::numeric_limits<double>::max_digits10);
+    for (auto& d_value : r.d_vars) out << d_value << " ";
+    for (auto& c_value : r.c_vars) out << c_value << " ";
+    out << r.action << " " << r.value << " " << r.count << " "
+            << r.select << " " << r.uncover << "\n";
+}
+
+/**
+ * Reads the next record of a table with the given sizes.
+ * @return false at the end of the table or on malformed input
+ */
+inline bool read_qrecord(std::istream& in, size_t d_size, size_t c_size, qrecord_t& r) {
+    r.d_vars.resize(d_size);
+    r.c_vars.resize(c_size);
+    for (auto& d_value : r.d_vars) in >> d_value;
+    for (auto& c_value : r.c_vars) in >> c_value;
+    in >> r.action >> r.value >> r.count >> r.select >> r.uncover;
+    return !in.fail();
+}
+
+/**
+ * Streaming k-way merge of saved tables. Only one record per input is held in
+ * memory at a time, so tables larger than memory can be merged.
+ * @param inputs paths of table files, each sorted as written by QLearner::save_table
+ * @param out stream receiving the merged table
+ * @return false (after reporting on stderr) if an input is missing, malformed,
+ * unsorted or has different state-vector sizes
+ */
+inline bool merge_qtable_files(const std::vector<std::string>& inputs, std::ostream& out) {
+    if (inputs.empty()) {
+        std::cerr << "merge_qtable_files: no input tables\n";
+        return false;
+    }
+    std::vector<std::ifstream> files(inputs.size());
+    std::vector<qrecord_t> heads(inputs.size());
+    size_t d_size = 0, c_size = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        files[i].open(inputs[i]);
+        size_t d = 0, c = 0;
+        if (!files[i] || !read_qtable_header(files[i], d, c)) {
+            std::cerr << "merge_qtable_files: " << inputs[i] << " is not a Q-table\n";
+            return false;
+        }
+        if (i == 0) {
+            d_size = d;
+            c_size = c;
+        } else if (d != d_size || c != c_size) {
+            std::cerr << "merge_qtable_files: " << inputs[i] << " has state sizes (" << d << ", " << c
+                    << "), expected (" << d_size << ", " << c_size << ")\n";
+            return false;
+        }
+    }
+
+    // min-heap over the current record of each input
+    auto greater = [&heads](size_t a, size_t b) {
+        return qrecord_less(heads[b], heads[a]);
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> queue(greater);
+    std::vector<bool> started(inputs.size(), false);
+    // reads the next record of input i, 0 at its end and -1 on malformed or unsorted input
+    auto advance = [&](size_t i) {
+        qrecord_t next;
+        if (!read_qrecord(files[i], d_size, c_size, next)) {
+            files[i].clear();
+            files[i] >> std::ws;
+            return files[i].eof() ? 0 : -1;
+        }
+        if (started[i] && !qrecord_less(heads[i], next))
+            return -1;
+        started[i] = true;
+        heads[i] = std::move(next);
+        queue.push(i);
+        return 1;
+    };
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (advance(i) < 0) {
+            std::cerr << "merge_qtable_files: malformed record in " << inputs[i] << "\n";
+            return false;
+        }
+    }
+
+    write_qtable_header(out, d_size, c_size);
+    while (!queue.empty()) {
+        size_t i = queue.top();
+        queue.pop();
+        qrecord_t merged = heads[i];
+        if (advance(i) < 0) {
+            std::cerr << "merge_qtable_files: malformed or unsorted record in " << inputs[i] << "\n";
+            return false;
+        }
+        while (!queue.empty() && qrecord_same_key(heads[queue.top()], merged)) {
+            size_t j = queue.top();
+            queue.pop();
+            qrecord_merge(merged, heads[j]);
+            if (advance(j) < 0) {
+                std::cerr << "merge_qtable_files: malformed or unsorted record in " << inputs[j] << "\n";
+                return false;
+            }
+        }
+        write_qrecord(out, merged);
+    }
+    return !out.fail();
+}
+
+#endif /* QTABLE_IO_H */
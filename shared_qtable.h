@@ -0,0 +1,414 @@
+/*
+ * File:   shared_qtable.h
+ *
+ * Q-table kept in a memory-mapped file, so that several verifyta processes on
+ * one host can learn into the same table (see RLSTRATEGO_SHARED_TABLE in
+ * uppaal_external_learner_alloc). Use a file under /dev/shm for a region that
+ * lives in shared memory only; remove the file to start from an empty table.
+ *
+ * The region holds no pointers, only a header and a fixed number of slots
+ * addressed by index:
+ *
+ *     header | slot_0 | slot_1 | ... | slot_{capacity-1}
+ *     slot   = state flag, hash, d_size + c_size state values, a_size entries
+ *
+ * Slots are found by open addressing with linear probing. Lookups take no
+ * lock: a slot's flag is set to full only after its state values are
+ * written. Claiming an empty slot, and reading or updating the entries of a
+ * state, happen under one of a fixed set of mutexes (a lock stripe), picked by
+ * the index of the slot or the hash of the state respectively.
+ *
+ * The mutexes are process-shared and robust, so a process killed while
+ * holding one (e.g. verifyta hitting a timeout) does not block the others:
+ * the next process to lock it takes it over. Every attached process holds a
+ * shared flock on the file; a process that opens the table while no other
+ * one holds it reinitializes the mutexes.
+ */
+
+#ifndef SHARED_QTABLE_H
+#define SHARED_QTABLE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class SharedQTable {
+public:
+
+    /**
+     * Q-value of one action of a state, see QLearner::qvalue_t; the flags set
+     * while evaluating a strategy stay with the learner that sets them
+     */
+    struct entry_t {
+        double value;
+        uint64_t count;
+    };
+
+private:
+    static const uint64_t magic = 0x5153545241544547ull; // "QSTRATEG"
+    static const uint32_t version = 3;
+    static const size_t n_locks = 4096;
+
+    enum : uint32_t {
+        slot_empty = 0, slot_full = 1
+    };
+
+    struct header_t {
+        std::atomic<uint32_t> ready;
+        uint32_t version;
+        uint64_t magic;
+        uint64_t is_minimization;
+        uint64_t d_size;
+        uint64_t c_size;
+        uint64_t a_size;
+        uint64_t capacity;
+        std::atomic<uint64_t> used;
+        pthread_mutex_t locks[n_locks];
+    };
+
+    struct slot_t {
+        std::atomic<uint32_t> state;
+        uint32_t padding;
+        uint64_t hash;
+        // followed by d_size + c_size doubles and a_size entries
+    };
+
+    int _fd = -1;
+    void* _region = nullptr;
+    size_t _region_size = 0;
+    header_t* _header = nullptr;
+    char* _slots = nullptr;
+    size_t _stride = 0;
+    size_t _key_size = 0;
+    size_t _a_size = 0;
+    size_t _capacity = 0;
+    bool _warned_full = false;
+    bool _warned_recovered = false;
+
+    SharedQTable() = default;
+
+    static size_t slot_size(size_t key_size, size_t a_size) {
+        return sizeof (slot_t) + key_size * sizeof (double) + a_size * sizeof (entry_t);
+    }
+
+    slot_t* slot(size_t index) const {
+        return reinterpret_cast<slot_t*> (_slots + index * _stride);
+    }
+
+    static double* key_of(slot_t* s) {
+        return reinterpret_cast<double*> (s + 1);
+    }
+
+    entry_t* entries_of(slot_t* s) const {
+        return reinterpret_cast<entry_t*> (key_of(s) + _key_size);
+    }
+
+    /**
+     * Copies the state into one key; -0.0 becomes 0.0 as the two are the same
+     * state for std::map but not for the hash.
+     */
+    bool make_key(const std::vector<double>& d_vars, const std::vector<double>& c_vars,
+            std::vector<double>& key, uint64_t& hash) const {
+        if (d_vars.size() + c_vars.size() != _key_size) return false;
+        key.resize(_key_size);
+        std::copy(d_vars.begin(), d_vars.end(), key.begin());
+        std::copy(c_vars.begin(), c_vars.end(), key.begin() + d_vars.size());
+        hash = 14695981039346656037ull; // FNV-1a over the bytes of the values
+        for (auto& v : key) {
+            v += 0.0;
+            uint64_t bits;
+            std::memcpy(&bits, &v, sizeof (bits));
+            for (int b = 0; b < 8; ++b) {
+                hash ^= (bits >> (8 * b)) & 0xff;
+                hash *= 1099511628211ull;
+            }
+        }
+        return true;
+    }
+
+    bool same_key(slot_t* s, uint64_t hash, const std::vector<double>& key) const {
+        return s->hash == hash && std::equal(key.begin(), key.end(), key_of(s));
+    }
+
+    /**
+     * Finds the slot of key, or claims an empty one for it if insert is set.
+     * @return the slot, or nullptr if the state is unknown (or the table full)
+     */
+    slot_t* probe(const std::vector<double>& key, uint64_t hash, bool insert) {
+        for (size_t i = 0; i < _capacity; ++i) {
+            const size_t index = (hash + i) % _capacity;
+            slot_t* s = slot(index);
+            if (s->state.load(std::memory_order_acquire) == slot_empty) {
+                if (!insert) return nullptr;
+                if (_header->used.load(std::memory_order_relaxed) * 10 >= _capacity * 9) {
+                    // keep probe sequences short, refuse inserts into a nearly full table
+                    if (!_warned_full) {
+                        std::cerr << "Shared Q-table is full (" << _capacity
+                                << " states), new states are dropped; raise RLSTRATEGO_SHARED_SLOTS\n";
+                        _warned_full = true;
+                    }
+                    return nullptr;
+                }
+                if (claim(s, index, key, hash)) return s;
+                // another process claimed the slot first, look at what it wrote
+            }
+            if (same_key(s, hash, key)) return s;
+        }
+        return nullptr;
+    }
+
+    /**
+     * Writes key into slot s, unless another process claimed it meanwhile.
+     * A process that dies while claiming leaves the slot empty.
+     */
+    bool claim(slot_t* s, size_t index, const std::vector<double>& key, uint64_t hash) {
+        auto& l = _header->locks[index % n_locks];
+        lock(l);
+        const bool empty = s->state.load(std::memory_order_relaxed) == slot_empty;
+        if (empty) {
+            s->hash = hash;
+            std::copy(key.begin(), key.end(), key_of(s));
+            std::memset(entries_of(s), 0, _a_size * sizeof (entry_t));
+            s->state.store(slot_full, std::memory_order_release);
+            _header->used.fetch_add(1, std::memory_order_relaxed);
+        }
+        unlock(l);
+        return empty;
+    }
+
+    pthread_mutex_t& lock_of(uint64_t hash) const {
+        return _header->locks[(hash >> 7) % n_locks];
+    }
+
+    /**
+     * Locks l, taking it over if its owner died while holding it. The data it
+     * guards is then used as the owner left it: at worst one Q-value was
+     * updated without its count.
+     */
+    void lock(pthread_mutex_t& l) {
+        if (pthread_mutex_lock(&l) == EOWNERDEAD) {
+            pthread_mutex_consistent(&l);
+            if (!_warned_recovered) {
+                std::cerr << "Recovered a lock of the shared Q-table held by a process that died\n";
+                _warned_recovered = true;
+            }
+        }
+    }
+
+    static void unlock(pthread_mutex_t& l) {
+        pthread_mutex_unlock(&l);
+    }
+
+    /**
+     * Initializes the mutexes; only while no other process uses the table.
+     */
+    void init_locks() {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        for (auto& l : _header->locks) pthread_mutex_init(&l, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+
+public:
+
+    /**
+     * Maps the table at path, creating it with room for capacity states if it
+     * does not exist. An existing table must have been created for the same
+     * sizes and optimization direction.
+     * @return the table, or nullptr (after reporting on stderr) on failure
+     */
+    static SharedQTable* open(const std::string& path, bool is_minimization,
+            size_t d_size, size_t c_size, size_t a_size, size_t capacity) {
+        SharedQTable* table = new SharedQTable();
+        table->_key_size = d_size + c_size;
+        table->_a_size = a_size;
+        table->_stride = (slot_size(d_size + c_size, a_size) + 7) / 8 * 8;
+
+        bool creator = true;
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0666);
+        if (fd < 0 && errno == EEXIST) {
+            creator = false;
+            fd = ::open(path.c_str(), O_RDWR);
+        }
+        if (fd < 0) {
+            std::cerr << "Cannot open shared Q-table " << path << ": " << std::strerror(errno) << "\n";
+            delete table;
+            return nullptr;
+        }
+        table->_fd = fd;
+
+        if (creator) {
+            flock(fd, LOCK_EX); // attachers wait in LOCK_SH until the table is initialized
+            size_t size = sizeof (header_t) + capacity * table->_stride;
+            if (ftruncate(fd, size) != 0 || !table->map(size)) {
+                std::cerr << "Cannot allocate shared Q-table " << path << ": " << std::strerror(errno) << "\n";
+                ::unlink(path.c_str());
+                delete table;
+                return nullptr;
+            }
+            header_t* h = table->_header;
+            h->version = version;
+            h->magic = magic;
+            h->is_minimization = is_minimization;
+            h->d_size = d_size;
+            h->c_size = c_size;
+            h->a_size = a_size;
+            h->capacity = capacity;
+            table->init_locks();
+            h->ready.store(1, std::memory_order_release);
+        } else {
+            // wait for the creating process to size and initialize the region
+            struct stat st;
+            for (int tries = 0;; ++tries) {
+                if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof (header_t)) break;
+                if (tries == 1000) {
+                    std::cerr << "Shared Q-table " << path << " was never initialized\n";
+                    delete table;
+                    return nullptr;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            if (!table->map(st.st_size)) {
+                std::cerr << "Cannot map shared Q-table " << path << ": " << std::strerror(errno) << "\n";
+                delete table;
+                return nullptr;
+            }
+            header_t* h = table->_header;
+            for (int tries = 0; h->ready.load(std::memory_order_acquire) == 0; ++tries) {
+                if (tries == 1000) {
+                    std::cerr << "Shared Q-table " << path << " was never initialized\n";
+                    delete table;
+                    return nullptr;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            if (h->magic != magic || h->version != version || h->is_minimization != is_minimization
+                    || h->d_size != d_size || h->c_size != c_size || h->a_size != a_size
+                    || sizeof (header_t) + h->capacity * table->_stride != (size_t) st.st_size) {
+                std::cerr << "Shared Q-table " << path << " was created for another model\n";
+                delete table;
+                return nullptr;
+            }
+            if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+                // no other process is attached, drop whatever lock state the last ones left
+                table->init_locks();
+            }
+        }
+        flock(fd, LOCK_SH); // held until the file is closed
+        table->_capacity = table->_header->capacity;
+        return table;
+    }
+
+    ~SharedQTable() {
+        if (_region != nullptr) munmap(_region, _region_size);
+        if (_fd >= 0) ::close(_fd);
+    }
+
+    SharedQTable(const SharedQTable&) = delete;
+    SharedQTable& operator=(const SharedQTable&) = delete;
+
+    /**
+     * Calls f(action, entry) for each action of the state with a value, while
+     * holding the lock of the state.
+     * @return whether the state is in the table
+     */
+    template <typename F>
+    bool read(const std::vector<double>& d_vars, const std::vector<double>& c_vars, F&& f) {
+        thread_local std::vector<double> key;
+        uint64_t hash;
+        if (!make_key(d_vars, c_vars, key, hash)) return false;
+        slot_t* s = probe(key, hash, false);
+        if (s == nullptr) return false;
+        auto& l = lock_of(hash);
+        lock(l);
+        entry_t* entries = entries_of(s);
+        for (size_t a = 0; a < _a_size; ++a) {
+            if (entries[a].count != 0) f(a, entries[a]);
+        }
+        unlock(l);
+        return true;
+    }
+
+    /**
+     * Calls f(entry) on the entry of the state-action pair, adding the state
+     * first if needed, while holding the lock of the state.
+     * @return false if the pair could not be stored (table full or unknown action)
+     */
+    template <typename F>
+    bool update(const std::vector<double>& d_vars, const std::vector<double>& c_vars, size_t action, F&& f) {
+        thread_local std::vector<double> key;
+        uint64_t hash;
+        if (action >= _a_size || !make_key(d_vars, c_vars, key, hash)) return false;
+        slot_t* s = probe(key, hash, true);
+        if (s == nullptr) return false;
+        auto& l = lock_of(hash);
+        lock(l);
+        f(entries_of(s)[action]);
+        unlock(l);
+        return true;
+    }
+
+    /**
+     * Calls f(key, entries) for every state in the table, where key holds the
+     * d_size discrete followed by the c_size continuous values.
+     */
+    template <typename F>
+    void for_each(F&& f) {
+        std::vector<entry_t> copy(_a_size);
+        for (size_t i = 0; i < _capacity; ++i) {
+            slot_t* s = slot(i);
+            if (s->state.load(std::memory_order_acquire) != slot_full) continue;
+            auto& l = lock_of(s->hash);
+            lock(l);
+            std::copy(entries_of(s), entries_of(s) + _a_size, copy.begin());
+            unlock(l);
+            f(static_cast<const double*> (key_of(s)), static_cast<const entry_t*> (copy.data()));
+        }
+    }
+
+    size_t size() const {
+        return _header->used.load(std::memory_order_relaxed);
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+    size_t a_size() const {
+        return _a_size;
+    }
+
+    size_t region_size() const {
+        return _region_size;
+    }
+
+private:
+
+    bool map(size_t size) {
+        void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (region == MAP_FAILED) return false;
+        _region = region;
+        _region_size = size;
+        _header = static_cast<header_t*> (region);
+        _slots = static_cast<char*> (region) + sizeof (header_t);
+        return true;
+    }
+};
+
+#endif /* SHARED_QTABLE_H */
@@ -0,0 +1,39 @@
+/*
+ * File:   merge_qtables.cpp
+ *
+ * Command-line front end of merge_qtable_files: combines Q-tables saved by
+ * independent learning processes (RLSTRATEGO_QTABLE_OUT) into one table that
+ * can be loaded again with RLSTRATEGO_QTABLE_IN.
+ *
+ *   merge_qtables -o <merged> <table> <table> ...
+ */
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "../qtable_io.h"
+
+int main(int argc, char** argv) {
+    std::string output;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            inputs.push_back(argv[i]);
+        }
+    }
+    if (output.empty() || inputs.empty()) {
+        std::cerr << "usage: " << argv[0] << " -o <merged> <table> [<table> ...]\n";
+        return 2;
+    }
+    std::ofstream out(output);
+    if (!out) {
+        std::cerr << "Cannot write " << output << "\n";
+        return 1;
+    }
+    return merge_qtable_files(inputs, out) ? 0 : 1;
+}
@@ -0,0 +1,177 @@
+/*
+ * File:   pgo_workload.cpp
+ *
+ * Synthetic learning workload for the learner library. It loads a build of
+ * the library the same way UPPAAL does (dlopen + uppaal_external_learner_*)
+ * and drives it through a learning phase (sample_handler, training predict,
+ * flush), a saveStrategy (print) and an evaluation phase (predict, print).
+ *
+ * Used by the release-pgo target in the Makefile:
+ *   pgo_workload train <library>            one run, to record a PGO profile
+ *   pgo_workload compare <debug> <release>  times both and reports the speedup
+ */
+
+#include <dlfcn.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace {
+
+    using alloc_t = void* (*)(bool, size_t, size_t, size_t);
+    using dealloc_t = void (*)(void*);
+    using print_t = char* (*)(void*);
+    using sample_t = void (*)(void*, size_t, double*, double*, double*, double*, double);
+    using predict_t = double (*)(void*, bool, size_t, double*, double*);
+    using flush_t = void (*)(void*);
+
+    const size_t d_size = 2;
+    const size_t c_size = 3;
+    const size_t a_size = 4;
+    const size_t iterations = 10; // learning batches
+    const size_t traces = 100; // traces per batch
+    const size_t trace_length = 60;
+    const size_t eval_runs = 200;
+
+    struct learner_lib {
+        void* handle = nullptr;
+        alloc_t alloc;
+        dealloc_t dealloc;
+        print_t print;
+        sample_t sample_handler;
+        predict_t predict;
+        flush_t flush;
+
+        bool open(const char* path) {
+            handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+            if (handle == nullptr) {
+                std::cerr << dlerror() << "\n";
+                return false;
+            }
+            alloc = (alloc_t) dlsym(handle, "uppaal_external_learner_alloc");
+            dealloc = (dealloc_t) dlsym(handle, "uppaal_external_learner_dealloc");
+            print = (print_t) dlsym(handle, "uppaal_external_learner_print");
+            sample_handler = (sample_t) dlsym(handle, "uppaal_external_learner_sample_handler");
+            predict = (predict_t) dlsym(handle, "uppaal_external_learner_predict");
+            flush = (flush_t) dlsym(handle, "uppaal_external_learner_flush");
+            if (!alloc || !dealloc || !print || !sample_handler || !predict || !flush) {
+                std::cerr << path << ": missing uppaal_external_learner_* symbols\n";
+                return false;
+            }
+            return true;
+        }
+    };
+
+    struct state_t {
+        double d[d_size];
+        double c[c_size];
+    };
+
+    /**
+     * Deterministic toy dynamics: a location in d[0], a mode in d[1] and three
+     * clocks/positions that drift depending on the action.
+     */
+    state_t step(const state_t& s, size_t action, std::mt19937& rng) {
+        std::uniform_real_distribution<double> noise(0.0, 1.0);
+        state_t t = s;
+        t.d[0] = std::fmod(s.d[0] + action + 1, 7);
+        t.d[1] = action % 2;
+        t.c[0] = std::fmod(s.c[0] + 0.5 + noise(rng) * action, 40.0);
+        t.c[1] = std::fmod(s.c[1] + noise(rng) * 3.0, 25.0);
+        t.c[2] = std::fmod(s.c[2] + (action == 3 ? 2.0 : 0.25), 15.0);
+        return t;
+    }
+
+    void run(const learner_lib& lib, unsigned seed) {
+        std::mt19937 rng(seed);
+        std::uniform_int_distribution<size_t> pick(0, a_size - 1);
+        std::vector<state_t> trace(trace_length + 1);
+        std::vector<size_t> actions(trace_length);
+        std::vector<double> costs(trace_length);
+
+        void* q = lib.alloc(true, d_size, c_size, a_size);
+        for (size_t it = 0; it < iterations; ++it) {
+            for (size_t t = 0; t < traces; ++t) {
+                trace[0] = state_t{{0, 0}, {0, 0, 0}};
+                for (size_t k = 0; k < trace_length; ++k) {
+                    // choose by the learner's training weights, like the simulator does
+                    double best = -1;
+                    actions[k] = pick(rng);
+                    for (size_t a = 0; a < a_size; ++a) {
+                        double w = lib.predict(q, false, a, trace[k].d, trace[k].c);
+                        if (w > best && pick(rng) != 0) {
+                            best = w;
+                            actions[k] = a;
+                        }
+                    }
+                    trace[k + 1] = step(trace[k], actions[k], rng);
+                    costs[k] = trace[k + 1].c[0] - trace[k].c[0] + actions[k];
+                }
+                // samples are delivered in reverse order; the last one reaches the sink
+                for (size_t k = trace_length; k-- > 0;) {
+                    bool last = k + 1 == trace_length;
+                    lib.sample_handler(q, actions[k], trace[k].d, trace[k].c,
+                            last ? nullptr : trace[k + 1].d, last ? nullptr : trace[k + 1].c, costs[k]);
+                }
+            }
+            lib.flush(q);
+        }
+        delete[] lib.print(q); // saveStrategy after learning
+
+        for (size_t r = 0; r < eval_runs; ++r) {
+            state_t s{{0, 0}, {0, 0, 0}};
+            for (size_t k = 0; k < trace_length; ++k) {
+                size_t chosen = pick(rng);
+                for (size_t a = 0; a < a_size; ++a) {
+                    if (lib.predict(q, true, a, s.d, s.c) > 0) chosen = a;
+                }
+                s = step(s, chosen, rng);
+            }
+            lib.flush(q);
+        }
+        delete[] lib.print(q);
+        lib.dealloc(q);
+    }
+
+    double time_run(const learner_lib& lib, size_t repeats) {
+        double best = std::numeric_limits<double>::infinity();
+        for (size_t r = 0; r < repeats; ++r) {
+            auto start = std::chrono::steady_clock::now();
+            run(lib, 42);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+        }
+        return best;
+    }
+}
+
+int main(int argc, char** argv) {
+    // keep the per-batch uncovered reports of the evaluation phase off the terminal
+    setenv("RLSTRATEGO_UNCOVERED_CSV", "/dev/null", 0);
+    if (argc == 3 && std::strcmp(argv[1], "train") == 0) {
+        learner_lib lib;
+        if (!lib.open(argv[2])) return 1;
+        run(lib, 42);
+        return 0;
+    }
+    if (argc == 4 && std::strcmp(argv[1], "compare") == 0) {
+        learner_lib debug, release;
+        if (!debug.open(argv[2]) || !release.open(argv[3])) return 1;
+        const size_t repeats = 3;
+        double t_debug = time_run(debug, repeats);
+        double t_release = time_run(release, repeats);
+        std::cout << "Debug:   " << t_debug << " s (" << argv[2] << ")\n"
+                << "Release: " << t_release << " s (" << argv[3] << ")\n"
+                << "Speedup: " << t_debug / t_release << "x\n";
+        return 0;
+    }
+    std::cerr << "usage: " << argv[0] << " train <library>\n"
+            << "       " << argv[0] << " compare <debug-library> <release-library>\n";
+    return 1;
+}
@@ -0,0 +1,123 @@
+/*
+ * File:   transition_store.h
+ *
+ * Bounded store of observed transitions (state, action, reward, successor)
+ * with an index from each state to the stored transitions leading into it.
+ * Used for prioritized sweeping at flush time (see QLearner::replay).
+ *
+ * Transitions are kept in a ring buffer; once it is full the oldest one is
+ * replaced. States are interned with a reference count, so every stored state
+ * is kept once and dropped with the last transition referring to it.
+ */
+
+#ifndef TRANSITION_STORE_H
+#define TRANSITION_STORE_H
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+template <typename state_t>
+class TransitionStore {
+public:
+
+    struct transition_t {
+        const state_t* from;
+        size_t action;
+        double reward;
+        const state_t* to;
+    };
+
+private:
+    std::vector<transition_t> _ring;
+    size_t _capacity;
+    size_t _next = 0; // slot to (over)write next
+    std::map<state_t, size_t> _states; // interned states and their reference counts
+    std::map<const state_t*, std::vector<size_t>> _predecessors; // slots of transitions into a state
+    std::vector<size_t> _recent; // slots written since the last take_recent
+    std::vector<bool> _is_recent;
+
+    const state_t* acquire(const state_t& state) {
+        auto it = _states.emplace(state, 0).first;
+        ++it->second;
+        return &it->first;
+    }
+
+    void release(const state_t* state) {
+        auto it = _states.find(*state);
+        if (--it->second == 0) {
+            _predecessors.erase(state);
+            _states.erase(it);
+        }
+    }
+
+public:
+
+    explicit TransitionStore(size_t capacity)
+    : _capacity(std::max<size_t>(capacity, 1)), _is_recent(_capacity, false) {
+        _ring.reserve(_capacity);
+    }
+
+    /**
+     * Stores a transition, replacing the oldest one if the store is full.
+     */
+    void add(const state_t& from, size_t action, double reward, const state_t& to) {
+        size_t slot = _next;
+        _next = (_next + 1) % _capacity;
+        if (slot < _ring.size()) {
+            // forget the transition in this slot
+            transition_t& old = _ring[slot];
+            auto& slots = _predecessors[old.to];
+            auto it = std::find(slots.begin(), slots.end(), slot);
+            *it = slots.back();
+            slots.pop_back();
+            release(old.from);
+            release(old.to);
+        } else {
+            _ring.emplace_back();
+        }
+        transition_t& t = _ring[slot];
+        t.from = acquire(from);
+        t.action = action;
+        t.reward = reward;
+        t.to = acquire(to);
+        _predecessors[t.to].push_back(slot);
+        if (!_is_recent[slot]) {
+            _is_recent[slot] = true;
+            _recent.push_back(slot);
+        }
+    }
+
+    const transition_t& operator[](size_t slot) const {
+        return _ring[slot];
+    }
+
+    /**
+     * Returns the slots of the stored transitions leading into state.
+     */
+    const std::vector<size_t>& predecessors(const state_t* state) const {
+        static const std::vector<size_t> none;
+        auto it = _predecessors.find(state);
+        return it != _predecessors.end() ? it->second : none;
+    }
+
+    /**
+     * Returns the slots written since the previous call and starts a new batch.
+     */
+    std::vector<size_t> take_recent() {
+        std::vector<size_t> recent;
+        recent.swap(_recent);
+        for (size_t slot : recent) _is_recent[slot] = false;
+        return recent;
+    }
+
+    size_t size() const {
+        return _ring.size();
+    }
+
+    size_t states() const {
+        return _states.size();
+    }
+};
+
+#endif /* TRANSITION_STORE_H */